@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cstdio>
+#include <glib.h>
+
+#include "background-gl.hpp"
+
+static const char *vertex_shader =
+    R"(
+attribute vec2 in_position;
+
+//uniform mat4 matrix;
+attribute highp vec2 uvpos;
+varying vec2 uv;
+
+void main() {
+    uv = uvpos;
+    gl_Position = vec4(in_position, 0.0, 1.0);
+}
+)";
+
+static const char *fragment_shader =
+    R"(
+precision highp float;
+uniform sampler2D bg_texture_from;
+uniform sampler2D bg_texture_to;
+uniform float progress;
+uniform vec4 from_adj;
+uniform vec4 to_adj;
+
+varying vec2 uv;
+
+void main() {
+    vec2 from_uv = vec2((uv.x * from_adj.z) - from_adj.x, (uv.y * from_adj.w) - from_adj.y);
+    vec2 to_uv = vec2((uv.x * to_adj.z) - to_adj.x, (uv.y * to_adj.w) - to_adj.y);
+    vec4 from = texture2D(bg_texture_from, from_uv);
+    vec4 to = texture2D(bg_texture_to, to_uv);
+    vec3 color = mix(from.rgb, to.rgb, progress);
+    gl_FragColor = vec4(color, 1.0);
+}
+)";
+
+/* Create and compile a shader */
+static GLuint create_shader(int type, const char *src)
+{
+    GLuint shader;
+    int status;
+
+    shader = glCreateShader(type);
+    glShaderSource(shader, 1, &src, NULL);
+    glCompileShader(shader);
+
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        int log_len;
+        char *buffer;
+
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_len);
+
+        buffer = (char*)g_malloc(log_len + 1);
+        glGetShaderInfoLog(shader, log_len, NULL, buffer);
+
+        printf("Compile failure in %s shader:\n%s",
+            type == GL_VERTEX_SHADER ? "vertex" : "fragment",
+            buffer);
+
+        g_free(buffer);
+
+        glDeleteShader(shader);
+
+        return 0;
+    }
+
+    return shader;
+}
+
+/* Initialize the shaders and link them into a program */
+static GLuint init_shaders()
+{
+    GLuint vertex, fragment;
+    GLuint program = 0;
+    int status;
+
+    vertex = create_shader(GL_VERTEX_SHADER, vertex_shader);
+
+    if (vertex == 0)
+    {
+        return 0;
+    }
+
+    fragment = create_shader(GL_FRAGMENT_SHADER, fragment_shader);
+
+    if (fragment == 0)
+    {
+        glDeleteShader(vertex);
+        return 0;
+    }
+
+    program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+
+    glLinkProgram(program);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        int log_len;
+        char *buffer;
+
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_len);
+
+        buffer = (char*)g_malloc(log_len + 1);
+        glGetProgramInfoLog(program, log_len, NULL, buffer);
+
+        g_warning("Linking failure:\n%s", buffer);
+
+        g_free(buffer);
+
+        glDeleteProgram(program);
+        program = 0;
+
+        goto out;
+    }
+
+    glDetachShader(program, vertex);
+    glDetachShader(program, fragment);
+
+out:
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+
+    return program;
+}
+
+bool BackgroundRenderer::init()
+{
+    static const float vertices[] = {
+        /* position */  /* uv */
+        1.0f, 1.0f,     1.0f, 0.0f,
+        -1.0f, 1.0f,    0.0f, 0.0f,
+        -1.0f, -1.0f,   0.0f, 1.0f,
+        1.0f, -1.0f,    1.0f, 1.0f,
+    };
+
+    program = init_shaders();
+    if (!program)
+    {
+        return false;
+    }
+
+    position_attrib  = glGetAttribLocation(program, "in_position");
+    uv_attrib        = glGetAttribLocation(program, "uvpos");
+    progress_uniform = glGetUniformLocation(program, "progress");
+    from_adj_uniform = glGetUniformLocation(program, "from_adj");
+    to_adj_uniform   = glGetUniformLocation(program, "to_adj");
+
+    /* The texture units never change */
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "bg_texture_from"), 0);
+    glUniform1i(glGetUniformLocation(program, "bg_texture_to"), 1);
+    glUseProgram(0);
+
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    return true;
+}
+
+void BackgroundRenderer::fini()
+{
+    glDeleteBuffers(1, &vbo);
+    glDeleteProgram(program);
+    vbo     = 0;
+    program = 0;
+}
+
+void BackgroundRenderer::draw(GLuint from_texture, const float from_adj[4],
+    GLuint to_texture, const float to_adj[4], float progress)
+{
+    glUseProgram(program);
+    if (from_texture)
+    {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, from_texture);
+    }
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, to_texture);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableVertexAttribArray(position_attrib);
+    glVertexAttribPointer(position_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(uv_attrib);
+    glVertexAttribPointer(uv_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float),
+        (void*)(2 * sizeof(float)));
+    glUniform1f(progress_uniform, progress);
+    glUniform4fv(from_adj_uniform, 1, from_adj);
+    glUniform4fv(to_adj_uniform, 1, to_adj);
+
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisableVertexAttribArray(position_attrib);
+    glDisableVertexAttribArray(uv_attrib);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+void background_alloc_texture(GLuint texture, const Glib::RefPtr<Gdk::Pixbuf>& source)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    auto format = source->get_has_alpha() ? GL_RGBA : GL_RGB;
+    glTexImage2D(GL_TEXTURE_2D, 0, format, source->get_width(),
+        source->get_height(), 0, format, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+int background_upload_rows(GLuint texture, const Glib::RefPtr<Gdk::Pixbuf>& source, int first_row)
+{
+    int height    = source->get_height();
+    int rowstride = source->get_rowstride();
+    int rows = std::clamp(UPLOAD_BYTES_PER_FRAME / std::max(rowstride, 1), 1, height - first_row);
+
+    /* Pixbuf rows are aligned to 4 bytes, which matches the default
+     * GL_UNPACK_ALIGNMENT, so rows can be uploaded straight from the pixbuf */
+    glBindTexture(GL_TEXTURE_2D, texture);
+    auto format = source->get_has_alpha() ? GL_RGBA : GL_RGB;
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first_row, source->get_width(), rows,
+        format, GL_UNSIGNED_BYTE, source->get_pixels() + (size_t)first_row * rowstride);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return rows;
+}
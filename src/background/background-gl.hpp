@@ -0,0 +1,58 @@
+#ifndef WF_BACKGROUND_GL_HPP
+#define WF_BACKGROUND_GL_HPP
+
+#include <epoxy/gl.h>
+#include <gdkmm/pixbuf.h>
+
+/* How much of an image is uploaded to the GPU per frame */
+#define UPLOAD_BYTES_PER_FRAME (4 << 20)
+
+/**
+ * The GL side of drawing a background: the shader program and the quad it
+ * is drawn with. It does not depend on GTK, so that the same code can be
+ * driven from an offscreen context by the benchmark.
+ *
+ * All methods expect the GL context to be current.
+ */
+class BackgroundRenderer
+{
+  public:
+    /* Compile the shaders and create the vertex buffer, false on failure */
+    bool init();
+    void fini();
+
+    bool is_ready()
+    {
+        return program != 0;
+    }
+
+    /**
+     * Draw to_texture faded in over from_texture. Adjustments are given as
+     * {x, y, scale_x, scale_y}. from_texture may be 0 if there is no
+     * previous image.
+     */
+    void draw(GLuint from_texture, const float from_adj[4],
+        GLuint to_texture, const float to_adj[4], float progress);
+
+  private:
+    GLuint program = 0;
+    GLuint vbo     = 0;
+    GLint position_attrib  = 0;
+    GLint uv_attrib        = 1;
+    GLint progress_uniform = -1;
+    GLint from_adj_uniform = -1;
+    GLint to_adj_uniform   = -1;
+};
+
+/* Allocate storage for the pixels of source in texture */
+void background_alloc_texture(GLuint texture, const Glib::RefPtr<Gdk::Pixbuf>& source);
+
+/**
+ * Upload the rows of source starting at first_row to texture, at most
+ * UPLOAD_BYTES_PER_FRAME of them.
+ *
+ * @return The number of rows uploaded.
+ */
+int background_upload_rows(GLuint texture, const Glib::RefPtr<Gdk::Pixbuf>& source, int first_row);
+
+#endif /* end of include guard: WF_BACKGROUND_GL_HPP */
@@ -1,4 +1,5 @@
 #include <wordexp.h>
+#include <sys/stat.h>
 #include <glibmm/main.h>
 #include <gtkmm.h>
 #include <gdkmm.h>
@@ -10,160 +11,36 @@
 
 #include <iostream>
 #include <map>
+#include <set>
 
 #include <gtk-utils.hpp>
+#include <wf-trace.hpp>
 #include <gtk4-layer-shell.h>
 #include <glib-unix.h>
 
 #include "background.hpp"
 
-
-
-static const char *vertex_shader =
-    R"(
-attribute vec2 in_position;
-
-//uniform mat4 matrix;
-attribute highp vec2 uvpos;
-varying vec2 uv;
-
-void main() {
-    uv = uvpos;
-    gl_Position = vec4(in_position, 0.0, 1.0);
-}
-)";
-
-static const char *fragment_shader =
-    R"(
-precision highp float;
-uniform sampler2D bg_texture_from;
-uniform sampler2D bg_texture_to;
-uniform float progress;
-uniform vec4 from_adj;
-uniform vec4 to_adj;
-
-varying vec2 uv;
-
-void main() {
-    vec2 from_uv = vec2((uv.x * from_adj.z) - from_adj.x, (uv.y * from_adj.w) - from_adj.y);
-    vec2 to_uv = vec2((uv.x * to_adj.z) - to_adj.x, (uv.y * to_adj.w) - to_adj.y);
-    vec4 from = texture2D(bg_texture_from, from_uv);
-    vec4 to = texture2D(bg_texture_to, to_uv);
-    vec3 color = mix(from.rgb, to.rgb, progress);
-    gl_FragColor = vec4(color, 1.0);
-}
-)";
-
-/* Create and compile a shader */
-static GLuint create_shader(int type, const char *src)
-{
-    GLuint shader;
-    int status;
-
-    shader = glCreateShader(type);
-    glShaderSource(shader, 1, &src, NULL);
-    glCompileShader(shader);
-
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    if (status == GL_FALSE)
-    {
-        int log_len;
-        char *buffer;
-
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_len);
-
-        buffer = (char*)g_malloc(log_len + 1);
-        glGetShaderInfoLog(shader, log_len, NULL, buffer);
-
-        printf("Compile failure in %s shader:\n%s",
-            type == GL_VERTEX_SHADER ? "vertex" : "fragment",
-            buffer);
-
-        g_free(buffer);
-
-        glDeleteShader(shader);
-
-        return 0;
-    }
-
-    return shader;
-}
-
-/* Initialize the shaders and link them into a program */
-static GLuint init_shaders()
+void BackgroundImage::generate_adjustments(int width, int height)
 {
-    GLuint vertex, fragment;
-    GLuint program = 0;
-    int status;
-
-    vertex = create_shader(GL_VERTEX_SHADER, vertex_shader);
-
-    if (vertex == 0)
+    if (source != nullptr)
     {
-        return 0;
+        image_width  = source->get_width();
+        image_height = source->get_height();
     }
 
-    fragment = create_shader(GL_FRAGMENT_SHADER, fragment_shader);
-
-    if (fragment == 0)
-    {
-        glDeleteShader(vertex);
-        return 0;
-    }
-
-    program = glCreateProgram();
-    glAttachShader(program, vertex);
-    glAttachShader(program, fragment);
-
-    glLinkProgram(program);
-
-    glGetProgramiv(program, GL_LINK_STATUS, &status);
-    if (status == GL_FALSE)
-    {
-        int log_len;
-        char *buffer;
-
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_len);
-
-        buffer = (char*)g_malloc(log_len + 1);
-        glGetProgramInfoLog(program, log_len, NULL, buffer);
-
-        g_warning("Linking failure:\n%s", buffer);
-
-        g_free(buffer);
-
-        glDeleteProgram(program);
-        program = 0;
-
-        goto out;
-    }
-
-    glDetachShader(program, vertex);
-    glDetachShader(program, fragment);
-
-out:
-    glDeleteShader(vertex);
-    glDeleteShader(fragment);
-
-    return program;
-}
-
-void BackgroundImage::generate_adjustments(int width, int height)
-{
     // Sanity checks
     if ((width == 0) ||
         (height == 0) ||
-        (source == nullptr) ||
-        (source->get_width() == 0) ||
-        (source->get_height() == 0))
+        (image_width == 0) ||
+        (image_height == 0))
     {
         return;
     }
 
     double screen_width  = (double)width;
     double screen_height = (double)height;
-    double source_width  = (double)source->get_width();
-    double source_height = (double)source->get_height();
+    double source_width  = (double)image_width;
+    double source_height = (double)image_height;
 
     adjustments = Glib::RefPtr<BackgroundImageAdjustments>(new BackgroundImageAdjustments());
     std::string fill_and_crop_string = "fill_and_crop";
@@ -217,6 +94,8 @@ void BackgroundImage::generate_adjustments(int width, int height)
 
 void BackgroundGLArea::show_image(Glib::RefPtr<BackgroundImage> next_image)
 {
+    pending_image = nullptr;
+    release_upload();
     if (!next_image || !next_image->source ||
         (background->window_width <= 0) || (background->window_height <= 0))
     {
@@ -225,269 +104,710 @@ void BackgroundGLArea::show_image(Glib::RefPtr<BackgroundImage> next_image)
         return;
     }
 
-    from_image = to_image;
-    to_image   = next_image;
-
-    int width, height;
+    /* Another output may already have uploaded the same image */
+    if (!next_image->texture)
+    {
+        next_image->texture = cache->find_texture(next_image->source);
+    }
 
-    to_image->generate_adjustments(background->window_width, background->window_height);
-    width  = to_image->source->get_width();
-    height = to_image->source->get_height();
-    glBindTexture(GL_TEXTURE_2D, to_image->tex_id);
-    auto format = to_image->source->get_has_alpha() ? GL_RGBA : GL_RGB;
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE,
-        to_image->source->get_pixels());
-    glBindTexture(GL_TEXTURE_2D, 0);
+    if (next_image->texture)
+    {
+        present_image(next_image);
+        return;
+    }
 
-    fade = {
-        fade_duration,
-        wf::animation::smoothing::sigmoid
-    };
-    fade.animate(0.0, 1.0);
+    /* Or be uploading it right now, as all outputs get the same image in
+     * the same iteration when they show the same one */
+    upload = cache->find_upload(next_image->source);
+    if (!upload)
+    {
+        /* Upload the image over several frames, so that large images do not
+         * block the main loop. The current image stays on screen meanwhile. */
+        this->make_current();
+        upload = std::make_shared<BackgroundUpload>();
+        upload->source  = next_image->source;
+        upload->texture = std::make_shared<BackgroundTexture>();
+        background_alloc_texture(upload->texture->id, upload->source);
+        cache->add_upload(upload->source, upload);
+    }
 
-    this->queue_draw();
+    next_image->texture = upload->texture;
+    pending_image = next_image;
+    start_tick();
 }
 
-static GLuint create_texture()
+/* Upload the next rows of the pending image, unless another output is
+ * already doing that. Returns true once the upload is complete. */
+bool BackgroundGLArea::upload_rows()
 {
-    GLuint tex;
+    if (!upload->driver)
+    {
+        upload->driver = this;
+    }
 
-    glGenTextures(1, &tex);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    if (!upload->complete && (upload->driver == this))
+    {
+        WfTraceSpan trace_upload{"background: texture upload", "sync"};
+        this->make_current();
+        upload->uploaded_rows += background_upload_rows(upload->texture->id,
+            upload->source, upload->uploaded_rows);
+        if (upload->uploaded_rows >= upload->source->get_height())
+        {
+            /* The other outputs draw the texture from their own contexts,
+             * which only see the pixels once they are flushed */
+            glFlush();
+            upload->complete = true;
+        }
+    }
 
-    return tex;
+    return upload->complete;
 }
 
-BackgroundImage::BackgroundImage()
+/* Stop waiting for the upload, another output takes over pushing it */
+void BackgroundGLArea::release_upload()
 {
-    tex_id = create_texture();
+    if (upload && (upload->driver == this))
+    {
+        upload->driver = nullptr;
+    }
+
+    upload = nullptr;
 }
 
-BackgroundImage::~BackgroundImage()
+void BackgroundGLArea::present_image(Glib::RefPtr<BackgroundImage> next_image)
 {
-    glDeleteTextures(1, &tex_id);
+    from_image = to_image;
+    to_image   = next_image;
+
+    background->adjust_image(*to_image);
+    cache->add_texture(to_image->source, to_image->texture);
+
+    /* The pixels live in the texture now. If they are needed again, for
+     * example for a fill mode change, the file is decoded again. */
+    if (background->is_low_memory())
+    {
+        to_image->source = nullptr;
+    }
+
+    start_fade();
 }
 
-Glib::RefPtr<BackgroundImage> WayfireBackground::create_from_file_safe(std::string path)
+BackgroundImageRequest WayfireBackground::create_request(const std::string& path)
 {
-    Glib::RefPtr<BackgroundImage> image = Glib::RefPtr<BackgroundImage>(new BackgroundImage());
-    image->fill_type = (std::string)background_fill_mode;
+    BackgroundImageRequest request;
+    request.path = path;
+    request.fill_mode = background_fill_mode;
 
-    try {
-        image->source = Gdk::Pixbuf::create_from_file(path);
-    } catch (...)
+    if (background_scaled_decode)
     {
-        return nullptr;
+        int scale = window->get_scale_factor();
+        request.width  = window_width * scale;
+        request.height = window_height * scale;
+        if (cycle->is_spanned())
+        {
+            /* Every output shows a part of the same image */
+            auto area = cycle->get_span_area();
+            request.width  = area.get_width() * scale;
+            request.height = area.get_height() * scale;
+        }
     }
 
-    if (image->source == nullptr)
+    return request;
+}
+
+void WayfireBackground::adjust_image(BackgroundImage& image)
+{
+    if (!cycle->is_spanned())
     {
-        return nullptr;
+        image.generate_adjustments(window_width, window_height);
+        return;
+    }
+
+    Gdk::Rectangle geometry;
+    output->monitor->get_geometry(geometry);
+    auto area = cycle->get_span_area();
+    image.generate_adjustments(area.get_width(), area.get_height());
+    if (!image.adjustments || !area.get_width() || !area.get_height())
+    {
+        return;
     }
 
-    return image;
+    /* Narrow the mapping for the whole area down to this output */
+    auto& adj = *image.adjustments;
+    double offset_x = (double)(geometry.get_x() - area.get_x()) / area.get_width();
+    double offset_y = (double)(geometry.get_y() - area.get_y()) / area.get_height();
+    adj.x -= offset_x * adj.scale_x;
+    adj.y -= offset_y * adj.scale_y;
+    adj.scale_x *= (double)geometry.get_width() / area.get_width();
+    adj.scale_y *= (double)geometry.get_height() / area.get_height();
 }
 
-bool WayfireBackground::change_background()
+void WayfireBackground::show_pixbuf(const BackgroundImageRequest& request,
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf)
 {
-    auto next_image = load_next_background();
-    if (!next_image)
+    Glib::RefPtr<BackgroundImage> image = Glib::RefPtr<BackgroundImage>(new BackgroundImage());
+    image->fill_type = request.fill_mode;
+    image->source    = pixbuf;
+    image->path   = request.path;
+    image->scaled = request.is_scaled();
+
+    shown_path = request.path;
+    std::cout << "Picked background " << request.path << std::endl;
+    gl_area->show_image(image);
+    uninhibit();
+
+    /* The next image was asked for while this one was still decoding */
+    if (!background_low_memory && !prefetch_path.empty() && (prefetch_path != shown_path))
     {
-        return false;
+        request_image(prefetch_path, false);
     }
+}
 
-    gl_area->show_image(next_image);
+void WayfireBackground::on_image_decoded(const BackgroundImageRequest& request,
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf)
+{
+    bool show = show_when_decoded;
+    decode_pending    = false;
+    show_when_decoded = false;
 
-    return true;
+    if (!pixbuf)
+    {
+        /* The cycle picks another image for every output showing this one */
+        cycle->image_failed(request.path);
+        if (show && !(decode_pending && show_when_decoded))
+        {
+            uninhibit();
+        }
+
+        return;
+    }
+
+    if (show)
+    {
+        show_pixbuf(request, pixbuf);
+    } else
+    {
+        prefetched = pixbuf;
+        prefetched_request = request;
+    }
 }
 
-bool WayfireBackground::load_images_from_dir(std::string path)
+void WayfireBackground::request_image(const std::string& path, bool show)
 {
-    wordexp_t exp;
+    cancel_decode();
+    decode_pending    = true;
+    show_when_decoded = show;
+    pending_path = path;
+
+    /* Results of cancelled requests may already be queued for delivery */
+    auto serial = ++decode_serial;
+    decode_ticket = cache->request(create_request(path),
+        [=] (const BackgroundImageRequest& request, Glib::RefPtr<Gdk::Pixbuf> pixbuf)
+    {
+        if (serial == decode_serial)
+        {
+            on_image_decoded(request, pixbuf);
+        }
+    });
+}
 
-    /* Expand path */
-    if (wordexp(path.c_str(), &exp, 0))
+void WayfireBackground::cancel_decode()
+{
+    cache->cancel(decode_ticket);
+    decode_serial++;
+    decode_pending    = false;
+    show_when_decoded = false;
+}
+
+void WayfireBackground::show(const std::string& path)
+{
+    /* Shown once the output has a size, see set_size() */
+    if (!window_width || !window_height)
     {
-        return false;
+        return;
     }
 
-    if (!exp.we_wordc)
+    if (decode_pending && show_when_decoded)
     {
-        wordfree(&exp);
-        return false;
+        if (pending_path == path)
+        {
+            return;
+        }
+    } else if (shown_path == path)
+    {
+        return;
     }
 
-    auto dir = opendir(exp.we_wordv[0]);
-    if (!dir)
+    if (prefetched && (prefetched_request.path == path))
     {
-        wordfree(&exp);
-        return false;
+        auto pixbuf  = prefetched;
+        auto request = prefetched_request;
+        prefetched.reset();
+        cancel_decode();
+        show_pixbuf(request, pixbuf);
+        return;
     }
 
-    /* Iterate over all files in the directory */
-    dirent *file;
-    while ((file = readdir(dir)) != 0)
+    if (decode_pending && (pending_path == path))
     {
-        /* Skip hidden files and folders */
-        if (file->d_name[0] == '.')
+        /* Already being prefetched */
+        show_when_decoded = true;
+        return;
+    }
+
+    prefetched.reset();
+    request_image(path, true);
+}
+
+void WayfireBackground::prefetch(const std::string& path)
+{
+    prefetch_path = path;
+    if (path.empty())
+    {
+        prefetched.reset();
+        if (decode_pending && !show_when_decoded)
         {
-            continue;
+            cancel_decode();
         }
 
-        auto fullpath = std::string(exp.we_wordv[0]) + "/" + file->d_name;
+        return;
+    }
+
+    /* In low memory mode the next image is decoded when it is due
+     * instead of being held in memory for a whole cycle */
+    if (background_low_memory || !window_width || !window_height || (path == shown_path))
+    {
+        return;
+    }
+
+    if ((prefetched && (prefetched_request.path == path)) ||
+        (decode_pending && (pending_path == path)))
+    {
+        return;
+    }
+
+    /* Started once the image which is due now is shown */
+    if (decode_pending && show_when_decoded)
+    {
+        return;
+    }
+
+    prefetched.reset();
+    request_image(path, false);
+}
 
-        struct stat next;
-        if (stat(fullpath.c_str(), &next) == 0)
+void WayfireBackground::clear()
+{
+    cancel_decode();
+    prefetched.reset();
+    prefetch_path.clear();
+    uninhibit();
+}
+
+/* The prefetched image may have been decoded for the old settings or size */
+void WayfireBackground::drop_stale_prefetch()
+{
+    if (prefetched)
+    {
+        auto request = create_request(prefetched_request.path);
+        request.mtime = prefetched_request.mtime;
+        if (!(request == prefetched_request))
         {
-            if (S_ISDIR(next.st_mode))
-            {
-                /* Recursive search */
-                load_images_from_dir(fullpath);
-            } else
-            {
-                images.push_back(fullpath);
-            }
+            prefetched.reset();
         }
     }
+}
 
-    wordfree(&exp);
+void WayfireBackground::update_background()
+{
+    drop_stale_prefetch();
 
-    if (background_randomize && images.size())
+    auto current = gl_area->get_current_image();
+    if (decode_pending && show_when_decoded)
     {
-        std::random_device random_device;
-        std::mt19937 random_gen(random_device());
-        std::shuffle(images.begin(), images.end(), random_gen);
+        request_image(pending_path, true);
+    } else if ((current != nullptr) && (current->scaled || !current->source))
+    {
+        /* The source only contains what the old settings showed */
+        request_image(current->path, true);
+    } else
+    {
+        if (current != nullptr)
+        {
+            Glib::RefPtr<BackgroundImage> image = Glib::RefPtr<BackgroundImage>(new BackgroundImage());
+            image->source    = current->source;
+            image->path      = current->path;
+            image->fill_type = background_fill_mode;
+            gl_area->show_image(image);
+        }
+
+        if (decode_pending)
+        {
+            cancel_decode();
+        }
+
+        prefetch(prefetch_path);
     }
+}
 
-    return true;
+void WayfireBackground::uninhibit()
+{
+    if (inhibited && output->output)
+    {
+        zwf_output_v2_inhibit_output_done(output->output);
+        inhibited = false;
+    }
 }
 
-Glib::RefPtr<BackgroundImage> WayfireBackground::load_next_background()
+BackgroundCycle::BackgroundCycle()
 {
-    Glib::RefPtr<BackgroundImage> image;
-    while (!image)
+    auto reload = [=] () { this->reload(); };
+    auto reset_cycle = [=] () { reset_cycle_timeout(); };
+    auto refit = [=] ()
+    {
+        refit_outputs();
+        update_outputs();
+    };
+    background_image.set_callback(reload);
+    background_randomize.set_callback(reload);
+    background_cycle_timeout.set_callback(reset_cycle);
+    background_output_mode.set_callback(refit);
+
+    /* The index learns about files as they are decoded */
+    image_info_conn = cache->signal_image_info().connect([=] (const BackgroundImageInfo& info)
     {
-        if (!images.size())
+        if (index)
         {
-            std::cerr << "Failed to load background images from " <<
-                    (std::string)background_image << std::endl;
-            // window.remove();
-            return nullptr;
+            index->set_image_info(info);
         }
+    });
+}
+
+BackgroundCycle::~BackgroundCycle()
+{
+    image_info_conn.disconnect();
+    index_changed_conn.disconnect();
+    change_bg_conn.disconnect();
+}
+
+void BackgroundCycle::add_output(WayfireBackground *output)
+{
+    outputs.push_back(output);
+    if (is_spanned())
+    {
+        refit_outputs();
+    }
+}
 
-        current_background = (current_background + 1) % images.size();
+void BackgroundCycle::remove_output(WayfireBackground *output)
+{
+    outputs.erase(std::remove(outputs.begin(), outputs.end(), output), outputs.end());
+    if (is_spanned())
+    {
+        refit_outputs();
+    }
+}
 
-        auto path = images[current_background];
-        image = create_from_file_safe(path);
+bool BackgroundCycle::is_spanned()
+{
+    return (std::string)background_output_mode == "span";
+}
 
-        if (!image)
+Gdk::Rectangle BackgroundCycle::get_span_area()
+{
+    Gdk::Rectangle area;
+    bool first = true;
+    for (auto bg : outputs)
+    {
+        Gdk::Rectangle geometry;
+        bg->get_output()->monitor->get_geometry(geometry);
+        if (first)
         {
-            images.erase(images.begin() + current_background);
+            area  = geometry;
+            first = false;
         } else
         {
-            std::cout << "Picked background " << path << std::endl;
+            area.join(geometry);
         }
     }
 
-    return image;
+    return area;
 }
 
-void WayfireBackground::update_background()
+/* How far the playlist moves on each change */
+size_t BackgroundCycle::get_step()
 {
-    Glib::RefPtr<BackgroundImage> image = Glib::RefPtr<BackgroundImage>(new BackgroundImage());
-    auto current = gl_area->get_current_image();
-    if (current != nullptr)
+    if ((std::string)background_output_mode == "per_output")
     {
-        image->source    = current->source;
-        image->fill_type = background_fill_mode;
-        gl_area->show_image(image);
+        return std::max<size_t>(outputs.size(), 1);
     }
+
+    return 1;
 }
 
-void WayfireBackground::reset_background()
+std::string BackgroundCycle::get_path(WayfireBackground *output, size_t position)
 {
-    images.clear();
-    current_background = 0;
-    change_bg_conn.disconnect();
+    size_t offset = 0;
+    if ((std::string)background_output_mode == "per_output")
+    {
+        offset = std::find(outputs.begin(), outputs.end(), output) - outputs.begin();
+    }
+
+    return images[(position + offset) % images.size()];
 }
 
-void WayfireBackground::set_background()
+/* The image the given output shows after the next change, if any */
+std::string BackgroundCycle::get_next_path(WayfireBackground *output)
 {
-    reset_background();
+    if (images.size() < 2)
+    {
+        return "";
+    }
 
-    std::string path = background_image;
-    try {
-        if (load_images_from_dir(path) && images.size())
+    return get_path(output, position + get_step());
+}
+
+void BackgroundCycle::update_outputs()
+{
+    if (images.empty())
+    {
+        return;
+    }
+
+    for (auto bg : outputs)
+    {
+        bg->show(get_path(bg, position));
+    }
+
+    for (auto bg : outputs)
+    {
+        bg->prefetch(get_next_path(bg));
+    }
+}
+
+void BackgroundCycle::refit_outputs()
+{
+    for (auto bg : outputs)
+    {
+        bg->update_background();
+    }
+}
+
+void BackgroundCycle::refresh(WayfireBackground *output)
+{
+    if (images.empty())
+    {
+        return;
+    }
+
+    output->show(get_path(output, position));
+    output->prefetch(get_next_path(output));
+}
+
+bool BackgroundCycle::change_background()
+{
+    if (images.size() < 2)
+    {
+        /* Nothing to cycle through */
+        return images.size() > 0;
+    }
+
+    position = (position + get_step()) % images.size();
+    update_outputs();
+    return true;
+}
+
+void BackgroundCycle::image_failed(const std::string& path)
+{
+    auto it = std::find(images.begin(), images.end(), path);
+    if (it != images.end())
+    {
+        /* Keep the position pointing at the same image */
+        size_t i = it - images.begin();
+        images.erase(it);
+        if ((i < position) && (position > 0))
         {
-            auto image = load_next_background();
-            if (!image)
-            {
-                throw std::exception();
-            }
+            position--;
+        }
+    }
 
-            gl_area->show_image(image);
-        } else
+    if (images.empty())
+    {
+        std::cerr << "Failed to load background image(s) " <<
+            (std::string)background_image << std::endl;
+        change_bg_conn.disconnect();
+        for (auto bg : outputs)
         {
-            auto image = create_from_file_safe(path);
-            if (!image)
+            bg->clear();
+        }
+
+        return;
+    }
+
+    position %= images.size();
+    update_outputs();
+}
+
+bool BackgroundCycle::load_images_from_dir(std::string path)
+{
+    wordexp_t exp;
+
+    /* Expand path */
+    if (wordexp(path.c_str(), &exp, 0))
+    {
+        return false;
+    }
+
+    if (!exp.we_wordc)
+    {
+        wordfree(&exp);
+        return false;
+    }
+
+    std::string dir = exp.we_wordv[0];
+    wordfree(&exp);
+
+    while ((dir.size() > 1) && (dir.back() == '/'))
+    {
+        dir.pop_back();
+    }
+
+    struct stat info;
+    if ((stat(dir.c_str(), &info) != 0) || !S_ISDIR(info.st_mode))
+    {
+        index = nullptr;
+        return false;
+    }
+
+    index = BackgroundImageIndex::get_instance(dir);
+    index_changed_conn = index->signal_changed().connect(
+        sigc::mem_fun(*this, &BackgroundCycle::on_index_changed));
+    images = index->get_images();
+
+    if (background_randomize && images.size())
+    {
+        std::random_device random_device;
+        std::mt19937 random_gen(random_device());
+        std::shuffle(images.begin(), images.end(), random_gen);
+    }
+
+    return true;
+}
+
+void BackgroundCycle::on_index_changed()
+{
+    bool was_empty = images.empty();
+    auto available = index->get_images();
+    std::set<std::string> in_index(available.begin(), available.end());
+
+    /* Drop removed files while keeping the position in the cycle */
+    for (size_t i = images.size(); i-- > 0;)
+    {
+        if (!in_index.count(images[i]))
+        {
+            images.erase(images.begin() + i);
+            if ((i < position) && (position > 0))
             {
-                throw std::exception();
+                position--;
             }
+        }
+    }
 
-            gl_area->show_image(image);
+    /* New files are added to the end of the cycle */
+    std::set<std::string> known(images.begin(), images.end());
+    for (auto& path : available)
+    {
+        if (!known.count(path))
+        {
+            images.push_back(path);
         }
-    } catch (...)
+    }
+
+    if (images.empty())
     {
-        std::cerr << "Failed to load background image(s) " << path << std::endl;
+        return;
     }
 
-    reset_cycle_timeout();
+    position %= images.size();
+    if (was_empty)
+    {
+        update_outputs();
+    }
 
-    if (inhibited && output->output)
+    if (!change_bg_conn.connected())
     {
-        zwf_output_v2_inhibit_output_done(output->output);
-        inhibited = false;
+        reset_cycle_timeout();
     }
 }
 
-void WayfireBackground::reset_cycle_timeout()
+void BackgroundCycle::reload()
+{
+    images.clear();
+    position = 0;
+    change_bg_conn.disconnect();
+    index_changed_conn.disconnect();
+    index = nullptr;
+
+    std::string path = background_image;
+    if (!load_images_from_dir(path))
+    {
+        /* A single file, it is dropped again if it fails to decode */
+        images.push_back(path);
+    }
+
+    if (images.empty())
+    {
+        std::cerr << "Failed to load background image(s) " << path << std::endl;
+        for (auto bg : outputs)
+        {
+            bg->clear();
+        }
+    }
+
+    update_outputs();
+    reset_cycle_timeout();
+}
+
+void BackgroundCycle::reset_cycle_timeout()
 {
     int cycle_timeout = background_cycle_timeout * 1000;
     change_bg_conn.disconnect();
-    if (images.size())
+    if (images.size() > 1)
     {
         change_bg_conn = Glib::signal_timeout().connect(sigc::mem_fun(
-            *this, &WayfireBackground::change_background), cycle_timeout);
+            *this, &BackgroundCycle::change_background), cycle_timeout);
     }
 }
 
 void BackgroundGLArea::realize()
 {
     this->make_current();
-    program = init_shaders();
+    renderer.init();
+}
+
+void BackgroundGLArea::unrealize()
+{
+    /* Textures which are not used by other outputs are deleted here, while
+     * the context is still there */
+    this->make_current();
+    pending_image = nullptr;
+    release_upload();
+    to_image   = nullptr;
+    from_image = nullptr;
+    renderer.fini();
 }
 
 bool BackgroundGLArea::render(const Glib::RefPtr<Gdk::GLContext>& context)
 {
-    static const float vertices[] = {
-        1.0f, 1.0f,
-        -1.0f, 1.0f,
-        -1.0f, -1.0f,
-        1.0f, -1.0f,
-    };
-    static const float uv_coords[] = {
-        1.0f, 0.0f,
-        0.0f, 0.0f,
-        0.0f, 1.0f,
-        1.0f, 1.0f,
-    };
-    static float from_adj[4] = {0.0, 0.0, 1.0, 1.0};
-    if (from_image)
+    glClearColor(0.0, 0.0, 0.0, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    if (!renderer.is_ready() || !to_image || !to_image->adjustments)
+    {
+        return true;
+    }
+
+    float from_adj[4] = {0.0, 0.0, 1.0, 1.0};
+    if (from_image && from_image->adjustments)
     {
         from_adj[0] = from_image->adjustments->x;
         from_adj[1] = from_image->adjustments->y;
@@ -495,61 +815,83 @@ bool BackgroundGLArea::render(const Glib::RefPtr<Gdk::GLContext>& context)
         from_adj[3] = from_image->adjustments->scale_y;
     }
 
-    static float to_adj[4] = {0.0, 0.0, 1.0, 1.0};
-    if (to_image)
+    float to_adj[4];
+    to_adj[0] = to_image->adjustments->x;
+    to_adj[1] = to_image->adjustments->y;
+    to_adj[2] = to_image->adjustments->scale_x;
+    to_adj[3] = to_image->adjustments->scale_y;
+
+    renderer.draw(from_image ? from_image->texture->id : 0, from_adj,
+        to_image->texture->id, to_adj, fade);
+
+    if (!fade.running())
     {
-        to_adj[0] = to_image->adjustments->x;
-        to_adj[1] = to_image->adjustments->y;
-        to_adj[2] = to_image->adjustments->scale_x;
-        to_adj[3] = to_image->adjustments->scale_y;
+        /* The old image is fully covered, its texture is not needed anymore */
+        from_image = nullptr;
     }
 
-    glClearColor(0.0, 0.0, 0.0, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glUseProgram(program);
-    if (from_image)
-    {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, from_image->tex_id);
-        GLuint from_tex_uniform = glGetUniformLocation(program, "bg_texture_from");
-        glUniform1i(from_tex_uniform, 0);
-    }
-
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, to_image->tex_id);
-    GLuint to_tex_uniform = glGetUniformLocation(program, "bg_texture_to");
-    glUniform1i(to_tex_uniform, 1);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, vertices);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, uv_coords);
-    GLuint progress = glGetUniformLocation(program, "progress");
-    glUniform1f(progress, fade);
-    GLuint from_adj_loc = glGetUniformLocation(program, "from_adj");
-    glUniform4fv(from_adj_loc, 1, from_adj);
-    GLuint to_adj_loc = glGetUniformLocation(program, "to_adj");
-    glUniform4fv(to_adj_loc, 1, to_adj);
-
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    glUseProgram(0);
+    return true;
+}
 
+void BackgroundGLArea::start_fade()
+{
+    fade = {
+        fade_duration,
+        wf::animation::smoothing::sigmoid
+    };
+    fade.animate(0.0, 1.0);
+
+    start_tick();
+    this->queue_draw();
+}
+
+void BackgroundGLArea::start_tick()
+{
+    if (!tick_id)
+    {
+        tick_id = add_tick_callback(sigc::mem_fun(*this, &BackgroundGLArea::update_frame));
+    }
+}
+
+/* Called once per frame by the frame clock while an image is uploaded
+ * or a fade is running */
+bool BackgroundGLArea::update_frame(const Glib::RefPtr<Gdk::FrameClock>& frame_clock)
+{
+    if (pending_image)
+    {
+        if (upload_rows())
+        {
+            auto image = pending_image;
+            pending_image = nullptr;
+            release_upload();
+            present_image(image);
+        }
+
+        return G_SOURCE_CONTINUE;
+    }
+
+    this->queue_draw();
     if (fade.running())
     {
-        Glib::signal_idle().connect([=] ()
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* The frame queued above draws the final state */
+    tick_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+void BackgroundGLArea::update_adjustments()
+{
+    for (auto image : {from_image, to_image})
+    {
+        if (image)
         {
-            this->queue_draw();
-            return false;
-        });
+            background->adjust_image(*image);
+        }
     }
 
-    return true;
+    this->queue_draw();
 }
 
 BackgroundGLArea::BackgroundGLArea(WayfireBackground *background)
@@ -565,10 +907,51 @@ BackgroundWindow::BackgroundWindow(WayfireBackground *background)
 void BackgroundWindow::size_allocate_vfunc(int width, int height, int baseline)
 {
     Gtk::Widget::size_allocate_vfunc(width, height, baseline);
-    background->window_width  = width;
-    background->window_height = height;
+    background->set_size(width, height);
+}
+
+void WayfireBackground::set_size(int width, int height)
+{
+    if ((width == (int)window_width) && (height == (int)window_height))
+    {
+        return;
+    }
+
+    window_width  = width;
+    window_height = height;
+
+    auto current = gl_area->get_current_image();
+    if (cycle->is_spanned())
+    {
+        /* The area covered by all outputs changed with this one, and with
+         * it the part of the image every output shows */
+        cycle->refit_outputs();
+        if (!current)
+        {
+            cycle->refresh(this);
+        }
+
+        return;
+    }
+
+    if (!current)
+    {
+        cycle->refresh(this);
+        return;
+    }
 
-    background->set_background();
+    /* Lay out what is shown for the new size until it is replaced */
+    gl_area->update_adjustments();
+    if (current->scaled || (decode_pending && show_when_decoded))
+    {
+        /* Decoded, and maybe cropped, for the old size */
+        update_background();
+    } else
+    {
+        /* The full image only needs a new mapping to the output */
+        drop_stale_prefetch();
+        prefetch(prefetch_path);
+    }
 }
 
 void WayfireBackground::setup_window()
@@ -589,23 +972,25 @@ void WayfireBackground::setup_window()
 
     gtk_layer_set_exclusive_zone(window->gobj(), -1);
     gl_area->signal_realize().connect(sigc::mem_fun(*gl_area, &BackgroundGLArea::realize));
+    gl_area->signal_unrealize().connect(sigc::mem_fun(*gl_area, &BackgroundGLArea::unrealize), false);
     gl_area->signal_render().connect(sigc::mem_fun(*gl_area, &BackgroundGLArea::render), false);
     window->set_child(*gl_area);
+    WfTrace::first_frame(*window, "background " + output->monitor->get_connector());
 
     auto update_background = [=] () { this->update_background(); };
-    auto set_background    = [=] () { this->set_background(); };
-    auto reset_cycle = [=] () { reset_cycle_timeout(); };
-    background_image.set_callback(set_background);
     background_fill_mode.set_callback(update_background);
-    background_cycle_timeout.set_callback(reset_cycle);
+    background_scaled_decode.set_callback(update_background);
+    background_low_memory.set_callback(update_background);
 
     window->present();
 }
 
-WayfireBackground::WayfireBackground(WayfireShellApp *app, WayfireOutput *output)
+WayfireBackground::WayfireBackground(WayfireShellApp *app, WayfireOutput *output,
+    BackgroundCycle *cycle)
 {
     this->app    = app;
     this->output = output;
+    this->cycle  = cycle;
 
     if (output->output)
     {
@@ -614,15 +999,18 @@ WayfireBackground::WayfireBackground(WayfireShellApp *app, WayfireOutput *output
     }
 
     setup_window();
+    cycle->add_output(this);
 }
 
 WayfireBackground::~WayfireBackground()
 {
-    reset_background();
+    cancel_decode();
+    cycle->remove_output(this);
 }
 
 class WayfireBackgroundApp : public WayfireShellApp
 {
+    std::unique_ptr<BackgroundCycle> cycle;
     std::map<WayfireOutput*, std::unique_ptr<WayfireBackground>> backgrounds;
 
   public:
@@ -637,8 +1025,19 @@ class WayfireBackgroundApp : public WayfireShellApp
 
     void handle_new_output(WayfireOutput *output) override
     {
+        /* Options can only be read once the config is loaded */
+        bool first = !cycle;
+        if (first)
+        {
+            cycle = std::make_unique<BackgroundCycle>();
+        }
+
         backgrounds[output] = std::unique_ptr<WayfireBackground>(
-            new WayfireBackground(this, output));
+            new WayfireBackground(this, output, cycle.get()));
+        if (first)
+        {
+            cycle->reload();
+        }
     }
 
     void handle_output_removed(WayfireOutput *output) override
@@ -648,9 +1047,12 @@ class WayfireBackgroundApp : public WayfireShellApp
 
     static gboolean sigusr1_handler(void *instance)
     {
-        for (const auto& [_, bg] : ((WayfireBackgroundApp*)instance)->backgrounds)
+        auto app = (WayfireBackgroundApp*)instance;
+        if (app->cycle)
         {
-            bg->change_background();
+            /* Give the image picked by hand the full time */
+            app->cycle->change_background();
+            app->cycle->reset_cycle_timeout();
         }
 
         return TRUE;
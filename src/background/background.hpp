@@ -9,6 +9,10 @@
 
 #include <epoxy/gl.h>
 
+#include "background-gl.hpp"
+#include "image-cache.hpp"
+#include "image-index.hpp"
+
 class WayfireBackground;
 
 class BackgroundImageAdjustments
@@ -21,22 +25,44 @@ class BackgroundImageAdjustments
 class BackgroundImage
 {
   public:
-    BackgroundImage();
-    ~BackgroundImage();
     Glib::RefPtr<Gdk::Pixbuf> source;
     std::string fill_type;
+    /* The file the image was decoded from. If scaled is set, source was
+     * decoded for the output size and fill_type and has to be decoded
+     * again when either of them changes. */
+    std::string path;
+    bool scaled = false;
     Glib::RefPtr<BackgroundImageAdjustments> adjustments;
 
+    /* Size of the source, kept after source is released */
+    int image_width  = 0;
+    int image_height = 0;
+
     void generate_adjustments(int width, int height);
-    GLuint tex_id = 0;
+    std::shared_ptr<BackgroundTexture> texture;
 };
 
 class BackgroundGLArea : public Gtk::GLArea
 {
     WayfireBackground *background;
-    GLuint program = 0;
+    std::shared_ptr<BackgroundImageCache> cache = BackgroundImageCache::get_instance();
+    BackgroundRenderer renderer;
+
     wf::animation::simple_animation_t fade;
     WfOption<int> fade_duration{"background/fade_duration"};
+    guint tick_id = 0;
+
+    /* Image whose texture is still being uploaded, and its upload, which
+     * may be shared with other outputs */
+    Glib::RefPtr<BackgroundImage> pending_image;
+    std::shared_ptr<BackgroundUpload> upload;
+
+    bool upload_rows();
+    void release_upload();
+    void present_image(Glib::RefPtr<BackgroundImage> image);
+    void start_fade();
+    void start_tick();
+    bool update_frame(const Glib::RefPtr<Gdk::FrameClock>& frame_clock);
 
     /* These two pixbufs are used for fading one background
      * image to the next when changing backgrounds or when
@@ -49,8 +75,10 @@ class BackgroundGLArea : public Gtk::GLArea
   public:
     BackgroundGLArea(WayfireBackground *background);
     void realize();
+    void unrealize();
     bool render(const Glib::RefPtr<Gdk::GLContext>& context);
     void show_image(Glib::RefPtr<BackgroundImage> image);
+    void update_adjustments();
     Glib::RefPtr<BackgroundImage> get_current_image()
     {
         return to_image;
@@ -68,39 +96,126 @@ class BackgroundWindow : public Gtk::Window
     void size_allocate_vfunc(int width, int height, int baseline) override;
 };
 
+/**
+ * Picks the images shown on the outputs. There is a single instance for the
+ * whole program, so all outputs share one timer and one playlist and change
+ * their backgrounds at the same time.
+ */
+class BackgroundCycle
+{
+    WfOption<std::string> background_image{"background/image"};
+    WfOption<int> background_cycle_timeout{"background/cycle_timeout"};
+    WfOption<bool> background_randomize{"background/randomize"};
+    WfOption<std::string> background_output_mode{"background/output_mode"};
+
+    std::vector<WayfireBackground*> outputs;
+    std::vector<std::string> images;
+    size_t position = 0;
+    sigc::connection change_bg_conn;
+
+    std::shared_ptr<BackgroundImageIndex> index;
+    sigc::connection index_changed_conn;
+    std::shared_ptr<BackgroundImageCache> cache = BackgroundImageCache::get_instance();
+    sigc::connection image_info_conn;
+
+    bool load_images_from_dir(std::string path);
+    void on_index_changed();
+    size_t get_step();
+    std::string get_path(WayfireBackground *output, size_t position);
+    std::string get_next_path(WayfireBackground *output);
+    void update_outputs();
+
+  public:
+    BackgroundCycle();
+    ~BackgroundCycle();
+
+    void add_output(WayfireBackground *output);
+    void remove_output(WayfireBackground *output);
+
+    /* Read the image option again and start over at the first image */
+    void reload();
+    /* Show the next image(s) on all outputs */
+    bool change_background();
+    /* Start the time until the next change over */
+    void reset_cycle_timeout();
+    /* Show the current image on the given output, for example once its
+     * size is known */
+    void refresh(WayfireBackground *output);
+    /* Decode or lay out the images again on all outputs, for when the
+     * output mode or, when spanning, the layout of the outputs changed */
+    void refit_outputs();
+    /* Drop a file which could not be decoded from the playlist */
+    void image_failed(const std::string& path);
+
+    /* Whether a single image is stretched across all outputs */
+    bool is_spanned();
+    /* Layout coordinates of the area covered by all outputs */
+    Gdk::Rectangle get_span_area();
+};
+
 class WayfireBackground
 {
     WayfireShellApp *app;
     WayfireOutput *output;
+    BackgroundCycle *cycle;
 
     Glib::RefPtr<BackgroundGLArea> gl_area;
-    std::vector<std::string> images;
     Glib::RefPtr<Gtk::Window> window;
 
     bool inhibited = false;
-    uint current_background;
-    sigc::connection change_bg_conn;
 
-    WfOption<std::string> background_image{"background/image"};
-    WfOption<int> background_cycle_timeout{"background/cycle_timeout"};
-    WfOption<bool> background_randomize{"background/randomize"};
     WfOption<std::string> background_fill_mode{"background/fill_mode"};
-
-    Glib::RefPtr<BackgroundImage> create_from_file_safe(std::string path);
-    bool background_transition_frame(int timer);
-    bool load_images_from_dir(std::string path);
-    Glib::RefPtr<BackgroundImage> load_next_background();
-    void reset_background();
-    void update_background();
-    void reset_cycle_timeout();
+    WfOption<bool> background_scaled_decode{"background/scaled_decode"};
+    WfOption<bool> background_low_memory{"background/low_memory"};
+
+    /* Images are decoded off the main thread through the cache shared by
+     * all outputs. The image which is due next is decoded ahead of time and
+     * kept in prefetched until the cycle gets to it. */
+    std::shared_ptr<BackgroundImageCache> cache = BackgroundImageCache::get_instance();
+    uint64_t decode_ticket = 0;
+    uint64_t decode_serial = 0;
+    bool decode_pending    = false;
+    bool show_when_decoded = false;
+    std::string pending_path;
+    std::string shown_path;
+    std::string prefetch_path;
+    Glib::RefPtr<Gdk::Pixbuf> prefetched;
+    BackgroundImageRequest prefetched_request;
+
+    BackgroundImageRequest create_request(const std::string& path);
+    void on_image_decoded(const BackgroundImageRequest& request, Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+    void show_pixbuf(const BackgroundImageRequest& request, Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+    void request_image(const std::string& path, bool show);
+    void cancel_decode();
+    void drop_stale_prefetch();
+    void uninhibit();
 
     void setup_window();
 
   public:
     guint window_width  = 0;
     guint window_height = 0;
-    WayfireBackground(WayfireShellApp *app, WayfireOutput *output);
-    void set_background();
-    bool change_background();
+    WayfireBackground(WayfireShellApp *app, WayfireOutput *output, BackgroundCycle *cycle);
+    void set_size(int width, int height);
+    bool is_low_memory()
+    {
+        return background_low_memory;
+    }
+
+    WayfireOutput *get_output()
+    {
+        return output;
+    }
+
+    /* Fade to the given file once it is decoded */
+    void show(const std::string& path);
+    /* Decode the given file ahead of time, so that showing it is instant */
+    void prefetch(const std::string& path);
+    /* Stop waiting for images, for when there are none left to show */
+    void clear();
+    /* Decode or lay out the current image again after a setting changed */
+    void update_background();
+    /* Map the image onto this output, or onto its part of the spanned area */
+    void adjust_image(BackgroundImage& image);
     ~WayfireBackground();
 };
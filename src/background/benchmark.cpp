@@ -0,0 +1,294 @@
+/*
+ * Benchmark for the wallpaper switching paths of wf-background.
+ *
+ * Synthetic images of several resolutions are written to a temporary
+ * directory and then decoded, uploaded and faded in the same way the
+ * background does it, repeatedly. GL runs in a surfaceless EGL context, so
+ * no compositor or GPU is needed (Mesa picks llvmpipe when there is none).
+ *
+ * Usage: wf-background-benchmark [iterations]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <epoxy/egl.h>
+#include <glib/gstdio.h>
+#include <glibmm/main.h>
+#include <glibmm/miscutils.h>
+#include <gtkmm/init.h>
+
+#include "background-gl.hpp"
+#include "image-cache.hpp"
+#include "image-loader.hpp"
+
+/* Size of the simulated output */
+#define OUTPUT_WIDTH  1920
+#define OUTPUT_HEIGHT 1080
+/* Frames per fade, one second at 60Hz */
+#define FADE_FRAMES 60
+
+using bench_clock = std::chrono::steady_clock;
+
+static double elapsed_ms(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+static long peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void report(const std::string& stage, const std::string& image, std::vector<double> samples)
+{
+    if (samples.empty())
+    {
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&] (double p)
+    {
+        return samples[(size_t)(p * (samples.size() - 1) + 0.5)];
+    };
+
+    printf("%-14s %-16s %6zu %9.2f %9.2f %9.2f %9.2f %10ld\n", stage.c_str(), image.c_str(),
+        samples.size(), percentile(0.5), percentile(0.9), percentile(0.99), samples.back(),
+        peak_rss_kb());
+}
+
+/* A gradient with some noise, so that compressed sizes are realistic */
+static Glib::RefPtr<Gdk::Pixbuf> create_image(int width, int height)
+{
+    auto pixbuf = Gdk::Pixbuf::create(Gdk::Colorspace::RGB, false, 8, width, height);
+    guint8 *pixels = pixbuf->get_pixels();
+    int rowstride  = pixbuf->get_rowstride();
+    uint32_t noise = 1;
+    for (int y = 0; y < height; y++)
+    {
+        guint8 *row = pixels + (size_t)y * rowstride;
+        for (int x = 0; x < width; x++)
+        {
+            noise = noise * 1664525 + 1013904223;
+            int n = (noise >> 24) & 0x1f;
+            row[3 * x]     = (255 * x / width + n) & 0xff;
+            row[3 * x + 1] = (255 * y / height + n) & 0xff;
+            row[3 * x + 2] = (128 + n) & 0xff;
+        }
+    }
+
+    return pixbuf;
+}
+
+static bool create_gl_context()
+{
+    EGLDisplay display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA,
+        EGL_DEFAULT_DISPLAY, NULL);
+    if ((display == EGL_NO_DISPLAY) || !eglInitialize(display, NULL, NULL))
+    {
+        std::cerr << "Failed to initialize a surfaceless EGL display" << std::endl;
+        return false;
+    }
+
+    eglBindAPI(EGL_OPENGL_ES_API);
+
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, 0,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+        EGL_NONE,
+    };
+    EGLConfig config;
+    EGLint num_configs = 0;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || !num_configs)
+    {
+        std::cerr << "No suitable EGL config" << std::endl;
+        return false;
+    }
+
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_CLIENT_VERSION, 2,
+        EGL_NONE,
+    };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    if ((context == EGL_NO_CONTEXT) ||
+        !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+        std::cerr << "Failed to create a surfaceless GLES2 context" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* Decode through the worker thread and wait for the result in the main loop,
+ * like the background does */
+static Glib::RefPtr<Gdk::Pixbuf> decode(const BackgroundImageRequest& request, double& latency)
+{
+    Glib::RefPtr<Gdk::Pixbuf> result;
+    auto loop = Glib::MainLoop::create();
+    BackgroundImageLoader loader([&] (const BackgroundImageRequest&, Glib::RefPtr<Gdk::Pixbuf> pixbuf)
+    {
+        result = pixbuf;
+        loop->quit();
+    });
+
+    auto start = bench_clock::now();
+    loader.request(request);
+    loop->run();
+    latency = elapsed_ms(start);
+
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = (argc > 1) ? std::max(1, atoi(argv[1])) : 10;
+
+    Gtk::init_gtkmm_internals();
+    if (!create_gl_context())
+    {
+        return EXIT_FAILURE;
+    }
+
+    /* Render into an offscreen framebuffer of output size */
+    GLuint framebuffer, target;
+    glGenTextures(1, &target);
+    glBindTexture(GL_TEXTURE_2D, target);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, OUTPUT_WIDTH, OUTPUT_HEIGHT, 0, GL_RGBA,
+        GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target, 0);
+    glViewport(0, 0, OUTPUT_WIDTH, OUTPUT_HEIGHT);
+
+    BackgroundRenderer renderer;
+    if (!renderer.init())
+    {
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "GL renderer: " << glGetString(GL_RENDERER) << std::endl;
+
+    char *dir = g_dir_make_tmp("wf-background-benchmark-XXXXXX", NULL);
+    if (!dir)
+    {
+        std::cerr << "Failed to create a temporary directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::vector<std::pair<int, int>> sizes = {
+        {1280, 720}, {1920, 1080}, {3840, 2160}, {7680, 4320},
+    };
+    std::vector<std::string> files;
+    for (auto [width, height] : sizes)
+    {
+        auto pixbuf = create_image(width, height);
+        for (auto format : {"jpeg", "png"})
+        {
+            auto file = Glib::build_filename(dir, std::to_string(width) + "x" +
+                std::to_string(height) + "." + format);
+            pixbuf->save(file, format);
+            files.push_back(file);
+        }
+    }
+
+    std::cout << "Output " << OUTPUT_WIDTH << "x" << OUTPUT_HEIGHT << ", " << iterations <<
+        " iterations, times in ms" << std::endl;
+    printf("%-14s %-16s %6s %9s %9s %9s %9s %10s\n", "stage", "image", "n", "p50", "p90",
+        "p99", "max", "rss_kb");
+
+    /* The image faded from, as in the background there always is one */
+    auto previous = std::make_shared<BackgroundTexture>();
+    auto black    = Gdk::Pixbuf::create(Gdk::Colorspace::RGB, false, 8, 1, 1);
+    black->fill(0x000000ff);
+    background_alloc_texture(previous->id, black);
+    background_upload_rows(previous->id, black, 0);
+
+    const float adj[4] = {0.0, 0.0, 1.0, 1.0};
+    for (auto& file : files)
+    {
+        auto name = Glib::path_get_basename(file);
+        std::vector<double> full_decode, scaled_decode, upload, upload_frame, fade_frame;
+
+        for (int i = 0; i < iterations; i++)
+        {
+            BackgroundImageRequest request;
+            request.path = file;
+            request.fill_mode = "fill_and_crop";
+
+            double latency;
+            auto pixbuf = decode(request, latency);
+            full_decode.push_back(latency);
+
+            request.width  = OUTPUT_WIDTH;
+            request.height = OUTPUT_HEIGHT;
+            auto scaled = decode(request, latency);
+            scaled_decode.push_back(latency);
+            if (!pixbuf || !scaled)
+            {
+                std::cerr << "Failed to decode " << file << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            /* The background uploads the scaled image, one chunk per frame */
+            auto texture = std::make_shared<BackgroundTexture>();
+            auto start   = bench_clock::now();
+            background_alloc_texture(texture->id, scaled);
+            for (int rows = 0; rows < scaled->get_height();)
+            {
+                auto frame_start = bench_clock::now();
+                rows += background_upload_rows(texture->id, scaled, rows);
+                glFinish();
+                upload_frame.push_back(elapsed_ms(frame_start));
+            }
+
+            upload.push_back(elapsed_ms(start));
+
+            for (int frame = 0; frame <= FADE_FRAMES; frame++)
+            {
+                auto frame_start = bench_clock::now();
+                glClearColor(0.0, 0.0, 0.0, 1.0);
+                glClear(GL_COLOR_BUFFER_BIT);
+                renderer.draw(previous->id, adj, texture->id, adj, (float)frame / FADE_FRAMES);
+                glFinish();
+                fade_frame.push_back(elapsed_ms(frame_start));
+            }
+
+            previous = texture;
+        }
+
+        report("decode_full", name, full_decode);
+        report("decode_scaled", name, scaled_decode);
+        report("upload", name, upload);
+        report("upload_frame", name, upload_frame);
+        report("fade_frame", name, fade_frame);
+    }
+
+    std::cout << "Peak RSS: " << peak_rss_kb() << " kB" << std::endl;
+
+    for (auto& file : files)
+    {
+        g_remove(file.c_str());
+    }
+
+    g_rmdir(dir);
+    g_free(dir);
+
+    previous.reset();
+    renderer.fini();
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &target);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <iostream>
+#include <sys/stat.h>
+#include <glibmm/main.h>
+#include <gdkmm/display.h>
+#include <gdkmm/glcontext.h>
+
+#include "image-cache.hpp"
+
+BackgroundTexture::BackgroundTexture()
+{
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/* The last user of a texture is often gone when no GL area is current, for
+ * example when an output was removed. A context of the display shares the
+ * textures of all GL areas, so it can delete them then. */
+static bool make_release_context_current()
+{
+    static Glib::RefPtr<Gdk::GLContext> context;
+
+    auto display = Gdk::Display::get_default();
+    if (!display)
+    {
+        return false;
+    }
+
+    try {
+        if (!context)
+        {
+            context = display->create_gl_context();
+            context->realize();
+        }
+
+        context->make_current();
+        return true;
+    } catch (const Glib::Error& e)
+    {
+        std::cerr << "Failed to create a GL context for releasing textures: " << e.what() << std::endl;
+        context.reset();
+        return false;
+    }
+}
+
+BackgroundTexture::~BackgroundTexture()
+{
+    bool made_current = !Gdk::GLContext::get_current() && make_release_context_current();
+    glDeleteTextures(1, &id);
+    if (made_current)
+    {
+        Gdk::GLContext::clear_current();
+    }
+}
+
+BackgroundImageCache::BackgroundImageCache() :
+    loader(sigc::mem_fun(*this, &BackgroundImageCache::on_image_decoded),
+        [=] (const BackgroundImageInfo& info) { image_info.emit(info); })
+{}
+
+uint64_t BackgroundImageCache::request(BackgroundImageRequest request, callback_t callback)
+{
+    struct stat info;
+    if (stat(request.path.c_str(), &info) == 0)
+    {
+        request.mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    }
+
+    auto ticket = next_ticket++;
+    tickets[ticket] = request;
+
+    /* Someone is already waiting for the same image */
+    bool in_flight = waiting.count(request);
+    waiting[request].push_back({ticket, callback});
+    if (in_flight)
+    {
+        return ticket;
+    }
+
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+    auto it = images.find(request);
+    if (it != images.end())
+    {
+        pixbuf = it->second.lock();
+    }
+
+    if (pixbuf)
+    {
+        std::weak_ptr<BackgroundImageCache> self = get_instance();
+        Glib::signal_idle().connect_once([self, request, pixbuf] ()
+        {
+            if (auto cache = self.lock())
+            {
+                cache->deliver(request, pixbuf);
+            }
+        });
+    } else
+    {
+        loader.request(request);
+    }
+
+    return ticket;
+}
+
+sigc::signal<void(const BackgroundImageInfo&)> BackgroundImageCache::signal_image_info()
+{
+    return image_info;
+}
+
+void BackgroundImageCache::cancel(uint64_t ticket)
+{
+    auto it = tickets.find(ticket);
+    if (it == tickets.end())
+    {
+        return;
+    }
+
+    auto request = it->second;
+    tickets.erase(it);
+
+    auto& waiters = waiting[request];
+    waiters.erase(std::remove_if(waiters.begin(), waiters.end(),
+        [=] (const waiter_t& waiter) { return waiter.ticket == ticket; }), waiters.end());
+    if (waiters.empty())
+    {
+        waiting.erase(request);
+        loader.cancel(request);
+    }
+}
+
+void BackgroundImageCache::on_image_decoded(const BackgroundImageRequest& request,
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf)
+{
+    if (pixbuf)
+    {
+        prune();
+        images[request] = pixbuf;
+    }
+
+    deliver(request, pixbuf);
+}
+
+void BackgroundImageCache::deliver(const BackgroundImageRequest& request,
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf)
+{
+    auto it = waiting.find(request);
+    if (it == waiting.end())
+    {
+        return;
+    }
+
+    auto waiters = std::move(it->second);
+    waiting.erase(it);
+    for (auto& waiter : waiters)
+    {
+        tickets.erase(waiter.ticket);
+    }
+
+    for (auto& waiter : waiters)
+    {
+        waiter.callback(request, pixbuf);
+    }
+}
+
+std::shared_ptr<BackgroundTexture> BackgroundImageCache::find_texture(
+    const Glib::RefPtr<Gdk::Pixbuf>& pixbuf)
+{
+    auto it = textures.find(pixbuf);
+    if (it == textures.end())
+    {
+        return nullptr;
+    }
+
+    return it->second.lock();
+}
+
+void BackgroundImageCache::add_texture(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+    const std::shared_ptr<BackgroundTexture>& texture)
+{
+    prune();
+    textures[pixbuf] = texture;
+}
+
+std::shared_ptr<BackgroundUpload> BackgroundImageCache::find_upload(
+    const Glib::RefPtr<Gdk::Pixbuf>& pixbuf)
+{
+    auto it = uploads.find(pixbuf);
+    if (it == uploads.end())
+    {
+        return nullptr;
+    }
+
+    auto upload = it->second.lock();
+    if (!upload || upload->complete)
+    {
+        return nullptr;
+    }
+
+    return upload;
+}
+
+void BackgroundImageCache::add_upload(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+    const std::shared_ptr<BackgroundUpload>& upload)
+{
+    prune();
+    uploads[pixbuf] = upload;
+}
+
+/* Forget images, textures and uploads which are not used by any output anymore */
+void BackgroundImageCache::prune()
+{
+    for (auto it = images.begin(); it != images.end();)
+    {
+        it = it->second.expired() ? images.erase(it) : std::next(it);
+    }
+
+    for (auto it = textures.begin(); it != textures.end();)
+    {
+        it = it->second.expired() ? textures.erase(it) : std::next(it);
+    }
+
+    for (auto it = uploads.begin(); it != uploads.end();)
+    {
+        it = it->second.expired() ? uploads.erase(it) : std::next(it);
+    }
+}
+
+std::shared_ptr<BackgroundImageCache> BackgroundImageCache::get_instance()
+{
+    static std::weak_ptr<BackgroundImageCache> cache;
+
+    auto instance = cache.lock();
+    if (!instance)
+    {
+        instance = std::make_shared<BackgroundImageCache>();
+        cache    = instance;
+    }
+
+    return instance;
+}
@@ -0,0 +1,112 @@
+#ifndef WF_BACKGROUND_IMAGE_CACHE_HPP
+#define WF_BACKGROUND_IMAGE_CACHE_HPP
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <epoxy/gl.h>
+#include <sigc++/signal.h>
+
+#include "image-loader.hpp"
+
+/**
+ * A GL texture which deletes itself when the last user is gone.
+ *
+ * All GL contexts created by GTK for a display share their resources, so a
+ * single texture can be drawn by the GL areas on every output, and deleted
+ * from any of them, or from a context of its own if none is current.
+ */
+class BackgroundTexture
+{
+  public:
+    BackgroundTexture();
+    ~BackgroundTexture();
+    GLuint id = 0;
+};
+
+/**
+ * A texture whose pixels are being uploaded a few rows per frame. Outputs
+ * which show the same image wait for the same upload instead of starting
+ * their own. The first of them to get a frame pushes the rows.
+ */
+class BackgroundUpload
+{
+  public:
+    Glib::RefPtr<Gdk::Pixbuf> source;
+    std::shared_ptr<BackgroundTexture> texture;
+    int uploaded_rows = 0;
+    bool complete     = false;
+    /* The GL area pushing the rows, null until one takes over */
+    const void *driver = nullptr;
+};
+
+/**
+ * Process-wide cache of decoded wallpapers, shared by all outputs.
+ *
+ * Images are keyed by the full decode request (path, modification time,
+ * target size and fill mode). The cache only holds weak references: an image
+ * stays cached for as long as any output still shows or prefetched it. While
+ * an image is being decoded, further requests for it wait for the same decode.
+ */
+class BackgroundImageCache
+{
+  public:
+    /* pixbuf is null if the file could not be decoded */
+    using callback_t = std::function<void (const BackgroundImageRequest& request,
+        Glib::RefPtr<Gdk::Pixbuf> pixbuf)>;
+
+    /**
+     * Get the decoded image for the given request. The callback is always
+     * called from the main loop, never before request() returns.
+     *
+     * @return A ticket which can be passed to cancel().
+     */
+    uint64_t request(BackgroundImageRequest request, callback_t callback);
+
+    /* Drop the callback of the given request ticket */
+    void cancel(uint64_t ticket);
+
+    /* Emitted for every file which was decoded, or failed to */
+    sigc::signal<void(const BackgroundImageInfo&)> signal_image_info();
+
+    /* Find the texture which was already uploaded for the given pixbuf */
+    std::shared_ptr<BackgroundTexture> find_texture(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf);
+    void add_texture(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+        const std::shared_ptr<BackgroundTexture>& texture);
+
+    /* Find the upload of the given pixbuf which is still in progress */
+    std::shared_ptr<BackgroundUpload> find_upload(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf);
+    void add_upload(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+        const std::shared_ptr<BackgroundUpload>& upload);
+
+    static std::shared_ptr<BackgroundImageCache> get_instance();
+    BackgroundImageCache();
+
+  private:
+    struct waiter_t
+    {
+        uint64_t ticket;
+        callback_t callback;
+    };
+
+    std::map<BackgroundImageRequest, std::weak_ptr<Gdk::Pixbuf>> images;
+    std::map<BackgroundImageRequest, std::vector<waiter_t>> waiting;
+    std::map<uint64_t, BackgroundImageRequest> tickets;
+    std::map<std::weak_ptr<Gdk::Pixbuf>, std::weak_ptr<BackgroundTexture>,
+        std::owner_less<std::weak_ptr<Gdk::Pixbuf>>> textures;
+    std::map<std::weak_ptr<Gdk::Pixbuf>, std::weak_ptr<BackgroundUpload>,
+        std::owner_less<std::weak_ptr<Gdk::Pixbuf>>> uploads;
+    uint64_t next_ticket = 1;
+
+    sigc::signal<void(const BackgroundImageInfo&)> image_info;
+    BackgroundImageLoader loader;
+
+    void on_image_decoded(const BackgroundImageRequest& request, Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+    void deliver(const BackgroundImageRequest& request, Glib::RefPtr<Gdk::Pixbuf> pixbuf);
+    void prune();
+};
+
+#endif /* end of include guard: WF_BACKGROUND_IMAGE_CACHE_HPP */
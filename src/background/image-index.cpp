@@ -0,0 +1,527 @@
+#include <cstdio>
+#include <dirent.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glibmm/main.h>
+
+#include "image-index.hpp"
+
+#define INDEX_HEADER "# wf-background image index v3"
+
+static int64_t get_mtime(const struct stat& info)
+{
+    return (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+/* Split the line at the first count - 1 tabs. The last field is the rest of
+ * the line, so that paths can contain tabs. */
+static std::vector<std::string> split_fields(const std::string& line, size_t count)
+{
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (fields.size() + 1 < count)
+    {
+        auto end = line.find('\t', start);
+        if (end == std::string::npos)
+        {
+            break;
+        }
+
+        fields.push_back(line.substr(start, end - start));
+        start = end + 1;
+    }
+
+    fields.push_back(line.substr(start));
+    return fields;
+}
+
+/* Whether path is a direct child of the directory dir */
+static bool is_child_of(const std::string& path, const std::string& dir)
+{
+    return (path.size() > dir.size() + 1) &&
+           (path.compare(0, dir.size(), dir) == 0) &&
+           (path[dir.size()] == '/') &&
+           (path.find('/', dir.size() + 1) == std::string::npos);
+}
+
+BackgroundImageIndex::BackgroundImageIndex(const std::string& root)
+{
+    this->root = root;
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (load() && directories.count(root))
+    {
+        /* Directory mtimes change when entries are added or removed, so only
+         * directories which changed since the index was written are read */
+        bool dirty = false;
+        auto known_directories = directories;
+        for (auto& [path, mtime] : known_directories)
+        {
+            if (!directories.count(path))
+            {
+                /* Removed together with its parent */
+                continue;
+            }
+
+            struct stat info;
+            if ((stat(path.c_str(), &info) != 0) || !S_ISDIR(info.st_mode))
+            {
+                remove_path(path);
+                dirty = true;
+            } else if (get_mtime(info) != mtime)
+            {
+                scan_directory(path, false);
+                dirty = true;
+            } else
+            {
+                add_watch(path);
+            }
+        }
+
+        /* Files can be fixed in place, which leaves their directory alone */
+        dirty |= recheck_invalid();
+        if (dirty)
+        {
+            save();
+        }
+    } else
+    {
+        files.clear();
+        directories.clear();
+        scan_directory(root, true);
+        save();
+    }
+
+    if (inotify_fd >= 0)
+    {
+        inotify_conn = Glib::signal_io().connect(
+            sigc::mem_fun(*this, &BackgroundImageIndex::handle_inotify_event),
+            inotify_fd, Glib::IOCondition::IO_IN);
+    }
+}
+
+BackgroundImageIndex::~BackgroundImageIndex()
+{
+    if (save_conn.connected())
+    {
+        save();
+    }
+
+    inotify_conn.disconnect();
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+    }
+}
+
+std::vector<std::string> BackgroundImageIndex::get_images()
+{
+    std::vector<std::string> images;
+    for (auto& [path, entry] : files)
+    {
+        if (entry.valid)
+        {
+            images.push_back(path);
+        }
+    }
+
+    return images;
+}
+
+void BackgroundImageIndex::set_image_info(const BackgroundImageInfo& info)
+{
+    auto it = files.find(info.path);
+    if (it == files.end())
+    {
+        return;
+    }
+
+    auto& entry = it->second;
+    if ((entry.mtime != info.mtime) || (entry.width != info.width) ||
+        (entry.height != info.height) || (entry.valid != info.valid))
+    {
+        entry.mtime  = info.mtime;
+        entry.width  = info.width;
+        entry.height = info.height;
+        entry.valid  = info.valid;
+        schedule_save();
+    }
+}
+
+/* Give invalid files which were modified since another chance */
+bool BackgroundImageIndex::recheck_invalid()
+{
+    bool modified = false;
+    for (auto& [path, entry] : files)
+    {
+        struct stat info;
+        if (!entry.valid && (stat(path.c_str(), &info) == 0) && (get_mtime(info) != entry.mtime))
+        {
+            entry = entry_t{};
+            entry.mtime = get_mtime(info);
+            modified    = true;
+        }
+    }
+
+    return modified;
+}
+
+sigc::signal<void()> BackgroundImageIndex::signal_changed()
+{
+    return changed;
+}
+
+std::string BackgroundImageIndex::get_index_file()
+{
+    std::string cache_dir;
+
+    char *cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home == NULL)
+    {
+        cache_dir = std::string(getenv("HOME")) + "/.cache";
+    } else
+    {
+        cache_dir = std::string(cache_home);
+    }
+
+    std::ostringstream file;
+    file << cache_dir << "/wf-shell/background-" << std::hex <<
+        std::hash<std::string>{}(root) << ".index";
+    return file.str();
+}
+
+bool BackgroundImageIndex::load()
+{
+    std::ifstream in(get_index_file());
+    std::string line;
+    if (!std::getline(in, line) || (line != INDEX_HEADER))
+    {
+        return false;
+    }
+
+    /* Different roots can end up with the same hash */
+    if (!std::getline(in, line) || (line != "R\t" + root))
+    {
+        return false;
+    }
+
+    try {
+        while (std::getline(in, line))
+        {
+            if (line.rfind("D\t", 0) == 0)
+            {
+                auto fields = split_fields(line, 3);
+                if (fields.size() != 3)
+                {
+                    return false;
+                }
+
+                directories[fields[2]] = std::stoll(fields[1]);
+            } else if (line.rfind("F\t", 0) == 0)
+            {
+                auto fields = split_fields(line, 6);
+                if (fields.size() != 6)
+                {
+                    return false;
+                }
+
+                entry_t entry;
+                entry.mtime  = std::stoll(fields[1]);
+                entry.width  = std::stoi(fields[2]);
+                entry.height = std::stoi(fields[3]);
+                entry.valid  = fields[4] == "1";
+                files[fields[5]] = entry;
+            }
+        }
+    } catch (const std::logic_error& e)
+    {
+        std::cerr << "Ignoring corrupt background index " << get_index_file() << std::endl;
+        files.clear();
+        directories.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void BackgroundImageIndex::save()
+{
+    save_conn.disconnect();
+
+    auto file = get_index_file();
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(file).parent_path(), error);
+
+    /* Write to a temporary file first, so that a crash never leaves a
+     * truncated index behind */
+    auto temp_file = file + ".tmp";
+    std::ofstream out(temp_file);
+    out << INDEX_HEADER << "\n";
+    out << "R\t" << root << "\n";
+    for (auto& [path, mtime] : directories)
+    {
+        out << "D\t" << mtime << "\t" << path << "\n";
+    }
+
+    for (auto& [path, entry] : files)
+    {
+        out << "F\t" << entry.mtime << "\t" << entry.width << "\t" << entry.height << "\t" <<
+            (entry.valid ? 1 : 0) << "\t" << path << "\n";
+    }
+
+    out.close();
+    if (out.fail() || (std::rename(temp_file.c_str(), file.c_str()) != 0))
+    {
+        std::cerr << "Failed to write background index " << file << std::endl;
+        std::remove(temp_file.c_str());
+    }
+}
+
+void BackgroundImageIndex::schedule_save()
+{
+    if (!save_conn.connected())
+    {
+        save_conn = Glib::signal_timeout().connect_seconds([=] ()
+        {
+            save();
+            return false;
+        }, 2);
+    }
+}
+
+void BackgroundImageIndex::scan_directory(const std::string& path, bool recursive)
+{
+    auto dir = opendir(path.c_str());
+    if (!dir)
+    {
+        return;
+    }
+
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0)
+    {
+        directories[path] = get_mtime(info);
+    }
+
+    add_watch(path);
+
+    std::set<std::string> seen;
+    dirent *file;
+    while ((file = readdir(dir)) != 0)
+    {
+        /* Skip hidden files and folders */
+        if (file->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        auto fullpath = path + "/" + file->d_name;
+        if (stat(fullpath.c_str(), &info) != 0)
+        {
+            continue;
+        }
+
+        seen.insert(fullpath);
+        if (S_ISDIR(info.st_mode))
+        {
+            if (recursive || !directories.count(fullpath))
+            {
+                scan_directory(fullpath, recursive);
+            }
+        } else
+        {
+            auto it = files.find(fullpath);
+            if ((it == files.end()) || (it->second.mtime != get_mtime(info)))
+            {
+                update_file(fullpath);
+            }
+        }
+    }
+
+    closedir(dir);
+
+    /* Forget whatever is not in the directory anymore */
+    std::vector<std::string> removed;
+    for (auto it = files.lower_bound(path + "/"); it != files.end(); ++it)
+    {
+        if (it->first.compare(0, path.size() + 1, path + "/") != 0)
+        {
+            break;
+        }
+
+        if (is_child_of(it->first, path) && !seen.count(it->first))
+        {
+            removed.push_back(it->first);
+        }
+    }
+
+    for (auto& [subdir, _] : directories)
+    {
+        if (is_child_of(subdir, path) && !seen.count(subdir))
+        {
+            removed.push_back(subdir);
+        }
+    }
+
+    for (auto& gone : removed)
+    {
+        remove_path(gone);
+    }
+}
+
+void BackgroundImageIndex::update_file(const std::string& path)
+{
+    struct stat info;
+    if ((path.find('\n') != std::string::npos) || (stat(path.c_str(), &info) != 0))
+    {
+        return;
+    }
+
+    /* Modified files get another chance to decode */
+    entry_t entry;
+    entry.mtime = get_mtime(info);
+    files[path] = entry;
+}
+
+void BackgroundImageIndex::remove_path(const std::string& path)
+{
+    auto prefix = path + "/";
+    auto in_tree = [&] (const std::string& other)
+    {
+        return (other == path) || (other.compare(0, prefix.size(), prefix) == 0);
+    };
+
+    files.erase(path);
+    for (auto it = files.lower_bound(prefix); it != files.end() && in_tree(it->first);)
+    {
+        it = files.erase(it);
+    }
+
+    directories.erase(path);
+    for (auto it = directories.lower_bound(prefix); it != directories.end() && in_tree(it->first);)
+    {
+        it = directories.erase(it);
+    }
+
+    for (auto it = watches.begin(); it != watches.end();)
+    {
+        if (in_tree(it->second))
+        {
+            inotify_rm_watch(inotify_fd, it->first);
+            it = watches.erase(it);
+        } else
+        {
+            ++it;
+        }
+    }
+}
+
+void BackgroundImageIndex::add_watch(const std::string& path)
+{
+    if (inotify_fd < 0)
+    {
+        return;
+    }
+
+    int wd = inotify_add_watch(inotify_fd, path.c_str(),
+        IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd >= 0)
+    {
+        watches[wd] = path;
+    }
+}
+
+bool BackgroundImageIndex::handle_inotify_event(Glib::IOCondition cond)
+{
+    alignas(inotify_event) char buf[4096];
+    bool modified = false;
+    ssize_t len;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        const inotify_event *event;
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(inotify_event) + event->len)
+        {
+            event = (const inotify_event*)ptr;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                scan_directory(root, true);
+                modified = true;
+                continue;
+            }
+
+            auto it = watches.find(event->wd);
+            if (it == watches.end())
+            {
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED)
+            {
+                watches.erase(it);
+                continue;
+            }
+
+            /* Skip hidden files and folders */
+            if (!event->len || (event->name[0] == '.'))
+            {
+                continue;
+            }
+
+            std::string dir  = it->second;
+            std::string path = dir + "/" + event->name;
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                remove_path(path);
+            } else if (event->mask & IN_ISDIR)
+            {
+                scan_directory(path, true);
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            {
+                update_file(path);
+            } else
+            {
+                /* Newly created files are indexed once they are written */
+                continue;
+            }
+
+            struct stat info;
+            if (stat(dir.c_str(), &info) == 0)
+            {
+                directories[dir] = get_mtime(info);
+            }
+
+            modified = true;
+        }
+    }
+
+    if (modified)
+    {
+        schedule_save();
+        changed.emit();
+    }
+
+    return true;
+}
+
+std::shared_ptr<BackgroundImageIndex> BackgroundImageIndex::get_instance(const std::string& root)
+{
+    static std::map<std::string, std::weak_ptr<BackgroundImageIndex>> indices;
+
+    auto instance = indices[root].lock();
+    if (!instance)
+    {
+        instance = std::make_shared<BackgroundImageIndex>(root);
+        indices[root] = instance;
+    }
+
+    return instance;
+}
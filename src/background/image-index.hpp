@@ -0,0 +1,81 @@
+#ifndef WF_BACKGROUND_IMAGE_INDEX_HPP
+#define WF_BACKGROUND_IMAGE_INDEX_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sigc++/connection.h>
+#include <sigc++/signal.h>
+#include <glibmm/iochannel.h>
+
+#include "image-loader.hpp"
+
+/**
+ * Index of all images in a wallpaper directory tree.
+ *
+ * The index is stored in $XDG_CACHE_HOME/wf-shell and kept up to date with
+ * inotify while the program runs. On startup only directories whose mtime
+ * changed since the index was written are read again, so an unchanged tree
+ * costs one file read and a stat() per directory instead of a full walk.
+ *
+ * Files are not opened here, as that would take long on large trees. Whether
+ * a file is an image, and its size, is found out by the decoder on its worker
+ * thread when the file is first picked, and stored with the file's mtime.
+ * Files which fail to decode are remembered as such until they are modified.
+ */
+class BackgroundImageIndex
+{
+  public:
+    BackgroundImageIndex(const std::string& root);
+    ~BackgroundImageIndex();
+
+    /* All files in the tree not known to be invalid, sorted by path */
+    std::vector<std::string> get_images();
+
+    /* Remember what decoding the file in its current state found out */
+    void set_image_info(const BackgroundImageInfo& info);
+
+    /* Emitted after files were added, removed or changed */
+    sigc::signal<void()> signal_changed();
+
+    /* Get the shared index for the given directory */
+    static std::shared_ptr<BackgroundImageIndex> get_instance(const std::string& root);
+
+  private:
+    struct entry_t
+    {
+        /* Of the file, when it was indexed or decoded */
+        int64_t mtime = 0;
+        /* 0 until the file was decoded */
+        int width  = 0;
+        int height = 0;
+        bool valid = true;
+    };
+
+    std::string root;
+    std::map<std::string, entry_t> files;
+    std::map<std::string, int64_t> directories;
+
+    int inotify_fd = -1;
+    std::map<int, std::string> watches;
+    sigc::connection inotify_conn;
+    sigc::connection save_conn;
+    sigc::signal<void()> changed;
+
+    std::string get_index_file();
+    bool load();
+    void save();
+    void schedule_save();
+
+    void scan_directory(const std::string& path, bool recursive);
+    bool recheck_invalid();
+    void update_file(const std::string& path);
+    void remove_path(const std::string& path);
+    void add_watch(const std::string& path);
+    bool handle_inotify_event(Glib::IOCondition cond);
+};
+
+#endif /* end of include guard: WF_BACKGROUND_IMAGE_INDEX_HPP */
@@ -0,0 +1,175 @@
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "image-loader.hpp"
+
+BackgroundImageLoader::BackgroundImageLoader(callback_t callback, info_callback_t info_callback)
+{
+    this->callback = callback;
+    this->info_callback = info_callback;
+    dispatcher.connect(sigc::mem_fun(*this, &BackgroundImageLoader::dispatch_results));
+    worker = std::thread(&BackgroundImageLoader::run, this);
+}
+
+BackgroundImageLoader::~BackgroundImageLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+
+    cond.notify_all();
+    worker.join();
+
+    for (auto& result : results)
+    {
+        if (result.pixbuf)
+        {
+            g_object_unref(result.pixbuf);
+        }
+    }
+}
+
+void BackgroundImageLoader::request(const BackgroundImageRequest& request)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(request);
+    }
+
+    cond.notify_one();
+}
+
+void BackgroundImageLoader::cancel(const BackgroundImageRequest& request)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.erase(std::remove(pending.begin(), pending.end(), request), pending.end());
+}
+
+/* Decode the image at the size it will be shown at. For fill_and_crop, only
+ * the part which ends up on screen is kept. The full size of the image is
+ * stored in source_width and source_height. */
+static GdkPixbuf *decode_scaled(const BackgroundImageRequest& request, GError **error,
+    int& source_width, int& source_height)
+{
+    source_width  = 0;
+    source_height = 0;
+    if (!request.is_scaled() ||
+        !gdk_pixbuf_get_file_info(request.path.c_str(), &source_width, &source_height) ||
+        (source_width <= 0) || (source_height <= 0))
+    {
+        GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(request.path.c_str(), error);
+        if (pixbuf)
+        {
+            source_width  = gdk_pixbuf_get_width(pixbuf);
+            source_height = gdk_pixbuf_get_height(pixbuf);
+        }
+
+        return pixbuf;
+    }
+
+    double scale_x = std::min(1.0, (double)request.width / source_width);
+    double scale_y = std::min(1.0, (double)request.height / source_height);
+
+    if (request.fill_mode == "stretch")
+    {
+        return gdk_pixbuf_new_from_file_at_scale(request.path.c_str(),
+            std::max(1, (int)(source_width * scale_x)),
+            std::max(1, (int)(source_height * scale_y)), FALSE, error);
+    }
+
+    double scale = (request.fill_mode == "fill_and_crop") ?
+        std::max(scale_x, scale_y) : std::min(scale_x, scale_y);
+    int width  = std::max(1, (int)std::round(source_width * scale));
+    int height = std::max(1, (int)std::round(source_height * scale));
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file_at_scale(request.path.c_str(),
+        width, height, FALSE, error);
+    if (!pixbuf || (request.fill_mode != "fill_and_crop"))
+    {
+        return pixbuf;
+    }
+
+    /* Keep only the centered region with the aspect ratio of the output */
+    width  = gdk_pixbuf_get_width(pixbuf);
+    height = gdk_pixbuf_get_height(pixbuf);
+    double aspect = (double)request.width / request.height;
+    int crop_width  = std::min(width, (int)std::round(height * aspect));
+    int crop_height = std::min(height, (int)std::round(width / aspect));
+    if ((crop_width >= width) && (crop_height >= height))
+    {
+        return pixbuf;
+    }
+
+    GdkPixbuf *visible = gdk_pixbuf_new_subpixbuf(pixbuf,
+        (width - crop_width) / 2, (height - crop_height) / 2,
+        std::max(1, crop_width), std::max(1, crop_height));
+    GdkPixbuf *cropped = gdk_pixbuf_copy(visible);
+    g_object_unref(visible);
+    g_object_unref(pixbuf);
+
+    return cropped;
+}
+
+/* Runs on the worker thread. Only the plain C API is used here, the
+ * C++ wrappers are created on the main thread in dispatch_results(). */
+void BackgroundImageLoader::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        cond.wait(lock, [=] { return quit || !pending.empty(); });
+        if (quit)
+        {
+            return;
+        }
+
+        auto request = pending.front();
+        pending.pop_front();
+        lock.unlock();
+
+        GError *error = nullptr;
+        int source_width, source_height;
+        GdkPixbuf *pixbuf = decode_scaled(request, &error, source_width, source_height);
+        if (error)
+        {
+            std::cerr << "Failed to decode " << request.path << ": " << error->message << std::endl;
+            g_error_free(error);
+        }
+
+        lock.lock();
+        results.push_back({request, pixbuf, source_width, source_height});
+        dispatcher.emit();
+    }
+}
+
+void BackgroundImageLoader::dispatch_results()
+{
+    std::deque<result_t> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.swap(results);
+    }
+
+    while (!ready.empty())
+    {
+        auto result = ready.front();
+        ready.pop_front();
+
+        Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+        if (result.pixbuf)
+        {
+            pixbuf = Glib::wrap(result.pixbuf);
+        }
+
+        if (info_callback)
+        {
+            info_callback({result.request.path, result.request.mtime,
+                result.source_width, result.source_height, (bool)pixbuf});
+        }
+
+        callback(result.request, pixbuf);
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef WF_BACKGROUND_IMAGE_LOADER_HPP
+#define WF_BACKGROUND_IMAGE_LOADER_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+
+#include <gdkmm/pixbuf.h>
+#include <glibmm/dispatcher.h>
+
+/**
+ * A single decode request. If width and height are set, the image is decoded
+ * at the size at which it will be shown with the given fill mode instead of
+ * its full resolution. Images are never scaled up.
+ */
+struct BackgroundImageRequest
+{
+    std::string path;
+    int width = 0;
+    int height = 0;
+    std::string fill_mode;
+    /* Modification time of the file, so that changed files are not
+     * served from the cache */
+    int64_t mtime = 0;
+
+    bool is_scaled() const
+    {
+        return width > 0 && height > 0;
+    }
+
+    bool operator <(const BackgroundImageRequest& other) const
+    {
+        return std::tie(path, mtime, width, height, fill_mode) <
+               std::tie(other.path, other.mtime, other.width, other.height, other.fill_mode);
+    }
+
+    bool operator ==(const BackgroundImageRequest& other) const
+    {
+        return !(*this < other) && !(other < *this);
+    }
+};
+
+/* What decoding a file found out about it */
+struct BackgroundImageInfo
+{
+    std::string path;
+    /* Of the file when it was decoded, see BackgroundImageRequest */
+    int64_t mtime = 0;
+    /* Full size of the image, 0 if it could not be read */
+    int width  = 0;
+    int height = 0;
+    bool valid = false;
+};
+
+/**
+ * Decodes wallpaper images on a worker thread.
+ *
+ * Requests are queued from the main thread and processed in order. Decoded
+ * pixbufs are handed back to the main loop through a Glib::Dispatcher, so the
+ * callback always runs on the GTK main thread.
+ */
+class BackgroundImageLoader
+{
+  public:
+    /* pixbuf is null if the file could not be decoded */
+    using callback_t = std::function<void (const BackgroundImageRequest& request,
+        Glib::RefPtr<Gdk::Pixbuf> pixbuf)>;
+
+    /* Called before callback, with the full size of the image */
+    using info_callback_t = std::function<void (const BackgroundImageInfo& info)>;
+
+    BackgroundImageLoader(callback_t callback, info_callback_t info_callback = nullptr);
+    ~BackgroundImageLoader();
+
+    /* Queue the given file for decoding */
+    void request(const BackgroundImageRequest& request);
+
+    /* Drop the request if it has not been started yet */
+    void cancel(const BackgroundImageRequest& request);
+
+  private:
+    struct result_t
+    {
+        BackgroundImageRequest request;
+        GdkPixbuf *pixbuf;
+        int source_width;
+        int source_height;
+    };
+
+    callback_t callback;
+    info_callback_t info_callback;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<BackgroundImageRequest> pending;
+    std::deque<result_t> results;
+    bool quit = false;
+
+    Glib::Dispatcher dispatcher;
+    std::thread worker;
+
+    void run();
+    void dispatch_results();
+};
+
+#endif /* end of include guard: WF_BACKGROUND_IMAGE_LOADER_HPP */
@@ -32,6 +32,7 @@
 #include "widgets/tray/tray.hpp"
 
 #include "wf-autohide-window.hpp"
+#include "wf-trace.hpp"
 
 class WayfirePanel::impl
 {
@@ -253,7 +254,10 @@ class WayfirePanel::impl
             }
 
             widget->widget_name = widget_name;
-            widget->init(&box);
+            {
+                WfTraceSpan trace_init{"init ", widget_name, "widget"};
+                widget->init(&box);
+            }
 
             container.push_back(std::move(widget));
         }
@@ -1,5 +1,6 @@
 #include "battery.hpp"
 #include <gtk-utils.hpp>
+#include <wf-trace.hpp>
 #include <iostream>
 #include <algorithm>
 
@@ -167,6 +168,7 @@ void WayfireBatteryInfo::update_state()
 
 bool WayfireBatteryInfo::setup_dbus()
 {
+    WfTraceSpan trace_setup{"battery: UPower proxies", "sync"};
     auto cancellable = Gio::Cancellable::create();
     connection = Gio::DBus::Connection::get_sync(Gio::DBus::BusType::SYSTEM, cancellable);
     if (!connection)
@@ -21,31 +21,39 @@ void WayfireLanguage::init(Gtk::Box *container)
     button.signal_clicked().connect(sigc::mem_fun(*this, &WayfireLanguage::next_layout));
     button.show();
 
-    ipc_client->subscribe(this, {"keyboard-modifier-state-changed"});
-    ipc_client->send("{\"method\":\"wayfire/get-keyboard-state\"}", [=] (wf::json_t data)
-    {
-        set_available(data["possible-layouts"]);
-        set_current(data["layout-index"]);
-    });
+    keyboard_changed = ipc_state->signal_keyboard_changed().connect(
+        sigc::mem_fun(*this, &WayfireLanguage::on_keyboard_changed));
+    on_keyboard_changed();
 
     container->append(button);
 }
 
-void WayfireLanguage::on_event(wf::json_t data)
+void WayfireLanguage::on_keyboard_changed()
 {
-    if (data["event"].as_string() == "keyboard-modifier-state-changed")
+    auto& keyboard = ipc_state->get_keyboard();
+    if (!keyboard.is_object() || !keyboard.has_member("possible-layouts"))
     {
-        if (available_layouts.size() == 0)
-        {
-            set_available(data["state"]["possible-layouts"]);
-        }
+        // Not known yet
+        return;
+    }
 
-        auto state_layout = data["state"]["layout-index"].as_uint();
-        if (state_layout != current_layout)
-        {
-            current_layout = state_layout;
-            set_current(state_layout);
-        }
+    // Looking the layouts up is expensive, and the state changes with every modifier
+    const wf::json_t& layouts = keyboard["possible-layouts"];
+    bool same_layouts = (layouts.size() == available_layouts.size());
+    for (size_t i = 0; same_layouts && (i < layouts.size()); i++)
+    {
+        same_layouts = (layouts[i].as_string() == available_layouts[i].Name);
+    }
+
+    if (!same_layouts)
+    {
+        set_available(layouts);
+    }
+
+    auto state_layout = keyboard["layout-index"].as_uint();
+    if (!same_layouts || (state_layout != current_layout))
+    {
+        set_current(state_layout);
     }
 }
 
@@ -66,7 +74,7 @@ void WayfireLanguage::set_current(uint32_t index)
     update_label();
 }
 
-void WayfireLanguage::set_available(wf::json_t layouts)
+void WayfireLanguage::set_available(const wf::json_t& layouts)
 {
     std::vector<Layout> layouts_available;
     std::map<std::string, uint32_t> names;
@@ -116,9 +124,10 @@ void WayfireLanguage::next_layout()
 WayfireLanguage::WayfireLanguage()
 {
     ipc_client = WayfireIPC::get_instance()->create_client();
+    ipc_state  = WayfireIPCState::get_instance();
 }
 
 WayfireLanguage::~WayfireLanguage()
 {
-    ipc_client->unsubscribe(this);
+    keyboard_changed.disconnect();
 }
@@ -4,6 +4,7 @@
 #include "../widget.hpp"
 #include "gtkmm/button.h"
 #include "wf-ipc.hpp"
+#include "wf-ipc-state.hpp"
 #include <cstdint>
 #include <gtkmm/calendar.h>
 #include <gtkmm/label.h>
@@ -17,21 +18,23 @@ struct Layout
     std::string ID;
 };
 
-class WayfireLanguage : public WayfireWidget, public IIPCSubscriber
+class WayfireLanguage : public WayfireWidget
 {
     // Gtk::Label label;
     Gtk::Button button;
 
     std::shared_ptr<IPCClient> ipc_client;
+    std::shared_ptr<WayfireIPCState> ipc_state;
+    sigc::connection keyboard_changed;
     uint32_t current_layout;
     std::vector<Layout> available_layouts;
 
   public:
     void init(Gtk::Box *container);
-    void on_event(wf::json_t data) override;
+    void on_keyboard_changed();
     bool update_label();
     void set_current(uint32_t index);
-    void set_available(wf::json_t layouts);
+    void set_available(const wf::json_t& layouts);
     void next_layout();
     WayfireLanguage();
     ~WayfireLanguage();
@@ -12,6 +12,7 @@
 #include "gtk-utils.hpp"
 #include "launchers.hpp"
 #include "wf-autohide-window.hpp"
+#include "wf-trace.hpp"
 
 const std::string default_icon = "wayfire";
 
@@ -402,6 +403,7 @@ void WayfireMenu::load_menu_items_from_dir(std::string path)
 
 void WayfireMenu::load_menu_items_all()
 {
+    WfTraceSpan trace_load{"menu: load all apps", "sync"};
     std::string home_dir = getenv("HOME");
     auto app_list = Gio::AppInfo::get_all();
     for (auto app : app_list)
@@ -3,6 +3,7 @@
 #include <cassert>
 #include <iostream>
 #include <gtk-utils.hpp>
+#include <wf-trace.hpp>
 
 #define NM_DBUS_NAME "org.freedesktop.NetworkManager"
 #define ACTIVE_CONNECTION "PrimaryConnection"
@@ -60,6 +61,7 @@ struct WifiConnectionInfo : public WfNetworkConnectionInfo
     {
         this->widget = widget;
 
+        WfTraceSpan trace_proxy{"network: access point proxy", "sync"};
         ap = Gio::DBus::Proxy::create_sync(connection, NM_DBUS_NAME, path,
             "org.freedesktop.NetworkManager.AccessPoint");
 
@@ -290,6 +292,7 @@ void WayfireNetworkInfo::update_status()
 
 void WayfireNetworkInfo::update_active_connection()
 {
+    WfTraceSpan trace_update{"network: active connection proxy", "sync"};
     Glib::Variant<Glib::ustring> active_conn_path;
     nm_proxy->get_cached_property(active_conn_path, ACTIVE_CONNECTION);
 
@@ -364,6 +367,7 @@ void WayfireNetworkInfo::on_nm_properties_changed(
 
 bool WayfireNetworkInfo::setup_dbus()
 {
+    WfTraceSpan trace_setup{"network: NetworkManager proxy", "sync"};
     auto cancellable = Gio::Cancellable::create();
     connection = Gio::DBus::Connection::get_sync(Gio::DBus::BusType::SYSTEM, cancellable);
     if (!connection)
@@ -4,64 +4,130 @@
 #include <iostream>
 #include <regex>
 
-void CssFromConfig::add_provider()
+CssFromConfigSheet::CssFromConfigSheet()
 {
+    provider = Gtk::CssProvider::create();
     Gtk::StyleContext::add_provider_for_display(
         Gdk::Display::get_default(), provider, GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
 }
 
-void CssFromConfig::remove_provider()
+CssFromConfigSheet::~CssFromConfigSheet()
 {
+    rebuild_connection.disconnect();
     Gtk::StyleContext::remove_provider_for_display(Gdk::Display::get_default(), provider);
 }
 
+std::shared_ptr<CssFromConfigSheet> CssFromConfigSheet::get_instance()
+{
+    static std::weak_ptr<CssFromConfigSheet> sheet;
+
+    auto instance = sheet.lock();
+    if (!instance)
+    {
+        instance = std::make_shared<CssFromConfigSheet>();
+        sheet    = instance;
+    }
+
+    return instance;
+}
+
+int CssFromConfigSheet::add_rule()
+{
+    rules[next_id] = "";
+    return next_id++;
+}
+
+void CssFromConfigSheet::set_rule(int id, const std::string& css)
+{
+    if (rules[id] != css)
+    {
+        rules[id] = css;
+        schedule_rebuild();
+    }
+}
+
+void CssFromConfigSheet::remove_rule(int id)
+{
+    rules.erase(id);
+    schedule_rebuild();
+}
+
+void CssFromConfigSheet::schedule_rebuild()
+{
+    if (!rebuild_connection.connected())
+    {
+        rebuild_connection = Glib::signal_idle().connect([=] ()
+        {
+            rebuild();
+            return false;
+        });
+    }
+}
+
+void CssFromConfigSheet::rebuild()
+{
+    std::string css;
+    for (auto& [_, rule] : rules)
+    {
+        css += rule + "\n";
+    }
+
+    provider->load_from_string(css);
+}
+
+CssFromConfig::CssFromConfig()
+{
+    rule = sheet->add_rule();
+}
+
+CssFromConfig::~CssFromConfig()
+{
+    sheet->remove_rule(rule);
+}
+
+void CssFromConfig::set_css(const std::string& css)
+{
+    sheet->set_rule(rule, css);
+}
+
 CssFromConfigBool::CssFromConfigBool(std::string option_name, std::string css_true, std::string css_false) :
     option_value{option_name}
 {
-    provider = Gtk::CssProvider::create();
     option_value.set_callback([=]
     {
-        provider->load_from_string(option_value ? css_true : css_false);
+        set_css(option_value ? css_true : css_false);
     });
-
-    add_provider();
 }
 
 CssFromConfigInt::CssFromConfigInt(std::string option_name, std::string css_before, std::string css_after) :
     option_value{option_name}
 {
-    provider = Gtk::CssProvider::create();
     option_value.set_callback([=]
     {
         // TODO When we go up to c++20 use std::format
         std::stringstream ss;
         ss << css_before << option_value << css_after;
-        provider->load_from_string(ss.str());
+        set_css(ss.str());
     });
     std::stringstream ss;
     ss << css_before << option_value << css_after;
-    provider->load_from_string(ss.str());
-
-    add_provider();
+    set_css(ss.str());
 }
 
 CssFromConfigString::CssFromConfigString(std::string option_name, std::string css_before,
     std::string css_after) :
     option_value{option_name}
 {
-    provider = Gtk::CssProvider::create();
     option_value.set_callback([=] ()
     {
         // TODO When we go up to c++20 use std::format
         std::stringstream ss;
         ss << css_before << (std::string)option_value << css_after;
-        provider->load_from_string(ss.str());
+        set_css(ss.str());
     });
     std::stringstream ss;
     ss << css_before << (std::string)option_value << css_after;
-    provider->load_from_string(ss.str());
-
-    add_provider();
+    set_css(ss.str());
 }
 
 CssFromConfigFont::CssFromConfigFont(std::string option_name, std::string css_before, std::string css_after) :
@@ -69,14 +135,12 @@ CssFromConfigFont::CssFromConfigFont(std::string option_name, std::string css_be
 {
     this->css_before = css_before;
     this->css_after  = css_after;
-    provider = Gtk::CssProvider::create();
     option_value.set_callback([=] ()
     {
         set_from_string();
     });
 
     set_from_string();
-    add_provider();
 }
 
 void CssFromConfigFont::set_from_string()
@@ -104,7 +168,7 @@ void CssFromConfigFont::set_from_string()
         ss << css_before << "font: " << size << unit << " " << before.str() << " " << after.str() << ";" <<
             css_after;
         auto css = ss.str();
-        provider->load_from_string(css);
+        set_css(css);
 
         std::cout << "Font " << css << std::endl;
     } else
@@ -112,7 +176,7 @@ void CssFromConfigFont::set_from_string()
         std::stringstream ss;
         ss << css_before << "font: 1rem " << font_name << ";" << css_after;
         auto css = ss.str();
-        provider->load_from_string(css);
+        set_css(css);
         std::cout << "Font fallback " << css << std::endl;
     }
 }
@@ -1,15 +1,52 @@
+#include <map>
+#include <memory>
 #include <string>
 #include <glibmm.h>
 #include <gtkmm.h>
 #include <wf-option-wrap.hpp>
 
-class CssFromConfig
+/**
+ * The stylesheet holding the rules generated from config options. One provider
+ * for all of them is cheaper for GTK than one per rule, and it is rebuilt at
+ * most once per main loop iteration, however many options changed.
+ */
+class CssFromConfigSheet
 {
   public:
+    CssFromConfigSheet();
+    ~CssFromConfigSheet();
+
+    /* Returns the id of a new, empty rule */
+    int add_rule();
+    void set_rule(int id, const std::string& css);
+    void remove_rule(int id);
+
+    static std::shared_ptr<CssFromConfigSheet> get_instance();
+
+  private:
     Glib::RefPtr<Gtk::CssProvider> provider;
+    /* By id, which is in order of creation, so that later rules take
+     * precedence as they did with a provider each */
+    std::map<int, std::string> rules;
+    int next_id = 0;
+    sigc::connection rebuild_connection;
+
+    void schedule_rebuild();
+    void rebuild();
+};
+
+class CssFromConfig
+{
+  public:
+    CssFromConfig();
+    virtual ~CssFromConfig();
+
+  protected:
+    void set_css(const std::string& css);
 
-    void add_provider();
-    void remove_provider();
+  private:
+    std::shared_ptr<CssFromConfigSheet> sheet = CssFromConfigSheet::get_instance();
+    int rule;
 };
 
 class CssFromConfigBool : public CssFromConfig
@@ -3,6 +3,7 @@
 
 #include <gtk4-layer-shell.h>
 #include <wf-shell-app.hpp>
+#include <wf-trace.hpp>
 #include <gdk/wayland/gdkwayland.h>
 #include <gtkmm.h>
 
@@ -26,6 +27,7 @@ WayfireAutohidingWindow::WayfireAutohidingWindow(WayfireOutput *output,
     gtk_layer_init_for_window(this->gobj());
     gtk_layer_set_monitor(this->gobj(), output->monitor->gobj());
     gtk_layer_set_namespace(this->gobj(), "panel");
+    WfTrace::first_frame(*this, section);
 
     this->position.set_callback([=] () { this->update_position(); });
     this->update_position();
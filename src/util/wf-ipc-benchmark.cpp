@@ -0,0 +1,253 @@
+/*
+ * Benchmark for the IPC client, against the mock server in the same process.
+ *
+ * Measures how many requests and events per second get through WayfireIPC,
+ * how long a request takes to be answered, how long an event takes from the
+ * socket to IIPCSubscriber::on_event(), and how long parsing a typical
+ * message takes. No compositor is needed.
+ *
+ * Usage: wf-ipc-benchmark [iterations]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <giomm/init.h>
+#include <glibmm/main.h>
+#include <glibmm/miscutils.h>
+#include <wayfire/nonstd/json.hpp>
+
+#include "wf-ipc.hpp"
+#include "wf-ipc-mock.hpp"
+
+/* Requests sent at once for the throughput stage */
+#define PIPELINE_REQUESTS 1000
+/* Requests sent one after another for the latency stage */
+#define SEQUENTIAL_REQUESTS 200
+/* Events sent at once for the event stages */
+#define FLOOD_EVENTS 10000
+/* Views in the synthetic view list used for the parse stage */
+#define PARSE_VIEWS 100
+
+#define BENCH_EVENT "wf-shell/benchmark"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double elapsed_ms(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+static void report(const std::string& stage, const std::string& unit, std::vector<double> samples)
+{
+    if (samples.empty())
+    {
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&] (double p)
+    {
+        return samples[(size_t)(p * (samples.size() - 1) + 0.5)];
+    };
+
+    printf("%-18s %-8s %8zu %12.3f %12.3f %12.3f %12.3f\n", stage.c_str(), unit.c_str(),
+        samples.size(), percentile(0.5), percentile(0.9), percentile(0.99), samples.back());
+}
+
+/* Run the main loop until done() holds */
+static void iterate_until(std::function<bool()> done)
+{
+    auto context = Glib::MainContext::get_default();
+    while (!done())
+    {
+        context->iteration(true);
+    }
+}
+
+static std::string make_view_list(int count)
+{
+    wf::json_t views = wf::json_t::array();
+    for (int i = 0; i < count; i++)
+    {
+        wf::json_t view;
+        view["id"]     = i;
+        view["app-id"] = "org.example.App" + std::to_string(i);
+        view["title"]  = "Window " + std::to_string(i) + " - Some document title";
+        view["type"]   = "toplevel";
+        view["role"]   = "toplevel";
+        view["mapped"] = true;
+        view["focusable"] = true;
+        view["minimized"] = false;
+        view["output-id"] = 1;
+        view["output-name"]  = "DP-1";
+        view["workspace"]["x"] = i % 3;
+        view["workspace"]["y"] = 0;
+        view["geometry"]["x"]  = 100 + i;
+        view["geometry"]["y"]  = 100;
+        view["geometry"]["width"]  = 1280;
+        view["geometry"]["height"] = 720;
+        views.append(view);
+    }
+
+    return views.serialize();
+}
+
+class BenchSubscriber : public IIPCSubscriber
+{
+  public:
+    int received = 0;
+    std::vector<double> latency;
+
+    void on_event(const wf::json_t& event) override
+    {
+        received++;
+        latency.push_back((MockIPCServer::now_ns() - event["sent-ns"].as_int64()) / 1e6);
+    }
+
+    /* Leaves the rest of the event unparsed, like a real subscriber would */
+    std::vector<std::string> get_event_fields() override
+    {
+        return {"sent-ns"};
+    }
+};
+
+int main(int argc, char **argv)
+{
+    int iterations = (argc > 1) ? std::max(1, atoi(argv[1])) : 5;
+
+    Gio::init();
+
+    auto socket_path = Glib::build_filename(Glib::get_tmp_dir(),
+        "wf-ipc-benchmark-" + std::to_string(getpid()) + ".sock");
+    MockIPCServer server(socket_path);
+    setenv("WAYFIRE_SOCKET", socket_path.c_str(), 1);
+
+    /* Like the reply of the compositor to a view list request */
+    auto view_list = make_view_list(PARSE_VIEWS);
+    server.set_response("window-rules/list-views", view_list);
+
+    auto ipc    = WayfireIPC::get_instance();
+    auto client = ipc->create_client();
+
+    std::cout << iterations << " iterations" << std::endl;
+    printf("%-18s %-8s %8s %12s %12s %12s %12s\n", "stage", "unit", "n", "p50", "p90", "p99", "max");
+
+    const std::string request = "{\"method\": \"wf-shell/benchmark\"}";
+
+    /* All requests are queued at once and go out in as few writes as possible */
+    std::vector<double> pipelined;
+    for (int i = 0; i < iterations; i++)
+    {
+        std::vector<std::string> messages(PIPELINE_REQUESTS, request);
+        bool done  = false;
+        auto start = bench_clock::now();
+        client->send_all(messages, [&] (const std::vector<wf::json_t>&)
+        {
+            done = true;
+        });
+        iterate_until([&] { return done; });
+        pipelined.push_back(PIPELINE_REQUESTS / (elapsed_ms(start) / 1000));
+    }
+
+    report("request_pipelined", "msg/s", pipelined);
+
+    /* Each request is sent once the previous one is answered */
+    std::vector<double> round_trip;
+    for (int i = 0; i < iterations; i++)
+    {
+        int remaining = SEQUENTIAL_REQUESTS;
+        auto start    = bench_clock::now();
+        std::function<void(const wf::json_t&)> next = [&] (const wf::json_t&)
+        {
+            round_trip.push_back(elapsed_ms(start));
+            if (--remaining > 0)
+            {
+                start = bench_clock::now();
+                client->send(request, next);
+            }
+        };
+        client->send(request, next);
+        iterate_until([&] { return remaining == 0; });
+    }
+
+    report("request_latency", "ms", round_trip);
+
+    std::vector<double> list_views;
+    for (int i = 0; i < iterations; i++)
+    {
+        bool done  = false;
+        auto start = bench_clock::now();
+        client->send("{\"method\": \"window-rules/list-views\"}", [&] (const wf::json_t&)
+        {
+            done = true;
+        });
+        iterate_until([&] { return done; });
+        list_views.push_back(elapsed_ms(start));
+    }
+
+    report("list_views", "ms", list_views);
+
+    std::vector<double> parse;
+    for (int i = 0; i < iterations * 100; i++)
+    {
+        wf::json_t parsed;
+        auto start = bench_clock::now();
+        wf::json_t::parse_string(view_list, parsed);
+        parse.push_back(elapsed_ms(start));
+    }
+
+    report("parse_views", "ms", parse);
+
+    /* What routing an event costs before anything is parsed */
+    auto view = make_view_list(1);
+    const std::string view_event = "{\"event\": \"view-geometry-changed\", \"view\": " +
+        view.substr(1, view.size() - 2) + "}";
+    std::vector<double> peek_samples;
+    for (int i = 0; i < iterations * 100; i++)
+    {
+        IPCMessagePeek peek;
+        std::string_view name;
+        auto start = bench_clock::now();
+        peek.scan(view_event);
+        peek.get_string("event", name);
+        peek_samples.push_back(elapsed_ms(start));
+    }
+
+    report("peek_event", "ms", peek_samples);
+
+    /* Events go through the same path as those of the compositor, so the
+     * server has to see the watch request before flooding */
+    BenchSubscriber subscriber;
+    int watches = server.get_request_count("window-rules/events/watch");
+    client->subscribe(&subscriber, {BENCH_EVENT});
+    iterate_until([&]
+    {
+        return server.get_request_count("window-rules/events/watch") > watches;
+    });
+
+    const std::string event = "{\"event\": \"" BENCH_EVENT "\", \"view\": {\"id\": 1, "
+                              "\"app-id\": \"org.example.App\", \"title\": \"Window\"}}";
+    std::vector<double> event_rate;
+    for (int i = 0; i < iterations; i++)
+    {
+        subscriber.received = 0;
+        auto start = bench_clock::now();
+        server.flood(event, FLOOD_EVENTS);
+        iterate_until([&] { return subscriber.received == FLOOD_EVENTS; });
+        event_rate.push_back(FLOOD_EVENTS / (elapsed_ms(start) / 1000));
+    }
+
+    report("event_flood", "msg/s", event_rate);
+    report("event_latency", "ms", subscriber.latency);
+
+    client->unsubscribe(&subscriber);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/*
+ * Stand-in for the Wayfire IPC socket, for running wf-shell clients without
+ * a compositor.
+ *
+ * Usage: wf-ipc-mock-server <socket> [script]
+ *
+ * The script is read line by line, from stdin if no file is given:
+ *   response <method> <json>   answer requests for method with json
+ *   wait <method> [count]      wait until count requests for method came in
+ *   flood <count> <json>       send count copies of the event json
+ *   sleep <ms>                 pause the script
+ * Empty lines and lines starting with # are skipped. The server keeps
+ * running after the end of the script until it is killed.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "wf-ipc-mock.hpp"
+
+static void run_script(MockIPCServer& server, std::istream& script)
+{
+    std::string line;
+    while (std::getline(script, line))
+    {
+        std::istringstream stream(line);
+        std::string command;
+        stream >> command;
+        if (command.empty() || (command[0] == '#'))
+        {
+            continue;
+        }
+
+        std::string rest;
+        if (command == "response")
+        {
+            std::string method;
+            stream >> method;
+            std::getline(stream >> std::ws, rest);
+            server.set_response(method, rest);
+        } else if (command == "wait")
+        {
+            std::string method;
+            int count = 1;
+            stream >> method >> count;
+            server.wait_for_requests(method, count);
+        } else if (command == "flood")
+        {
+            int count = 0;
+            stream >> count;
+            std::getline(stream >> std::ws, rest);
+            server.flood(rest, count);
+        } else if (command == "sleep")
+        {
+            int ms = 0;
+            stream >> ms;
+            std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+        } else
+        {
+            std::cerr << "Unknown command: " << line << std::endl;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <socket> [script]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    MockIPCServer server(argv[1]);
+    std::cout << "Listening on " << argv[1] << std::endl;
+
+    if (argc > 2)
+    {
+        std::ifstream script(argv[2]);
+        if (!script)
+        {
+            std::cerr << "Failed to open " << argv[2] << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        run_script(server, script);
+    } else
+    {
+        run_script(server, std::cin);
+    }
+
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::hours(1));
+    }
+}
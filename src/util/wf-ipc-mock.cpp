@@ -0,0 +1,279 @@
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <wayfire/nonstd/json.hpp>
+
+#include "wf-ipc-mock.hpp"
+
+/* Read exactly size bytes, false on EOF or error */
+static bool read_all(int fd, void *data, size_t size)
+{
+    char *ptr = (char*)data;
+    while (size > 0)
+    {
+        ssize_t received = recv(fd, ptr, size, 0);
+        if (received <= 0)
+        {
+            if ((received < 0) && (errno == EINTR))
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        ptr  += received;
+        size -= received;
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    const char *ptr = (const char*)data;
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, ptr, size, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        ptr  += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+MockIPCServer::MockIPCServer(const std::string& socket_path)
+{
+    this->socket_path = socket_path;
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("Socket path too long: " + socket_path);
+    }
+
+    std::strcpy(address.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((listen_fd < 0) ||
+        (bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0) ||
+        (listen(listen_fd, 1) != 0) ||
+        (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) != 0))
+    {
+        throw std::runtime_error("Failed to listen on " + socket_path + ": " + strerror(errno));
+    }
+
+    thread = std::thread(&MockIPCServer::run, this);
+}
+
+MockIPCServer::~MockIPCServer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+
+    wake();
+    thread.join();
+
+    for (int fd : {listen_fd, client_fd, wake_fds[0], wake_fds[1]})
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    unlink(socket_path.c_str());
+}
+
+int64_t MockIPCServer::now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void MockIPCServer::set_response(const std::string& method, const std::string& response)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    responses[method] = response;
+}
+
+void MockIPCServer::flood(const std::string& event, int count)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        floods.push_back({event, count});
+    }
+
+    wake();
+}
+
+int MockIPCServer::get_request_count(const std::string& method)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return request_counts[method];
+}
+
+void MockIPCServer::wait_for_requests(const std::string& method, int count)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&] { return quit || (request_counts[method] >= count); });
+}
+
+void MockIPCServer::wake()
+{
+    char byte = 0;
+    if (write(wake_fds[1], &byte, 1) < 0)
+    {
+        // The pipe is full, so a wakeup is pending anyway
+    }
+}
+
+void MockIPCServer::run()
+{
+    while (true)
+    {
+        pollfd fds[3] = {
+            {wake_fds[0], POLLIN, 0},
+            {listen_fd, POLLIN, 0},
+            {client_fd, POLLIN, 0},
+        };
+
+        if (poll(fds, (client_fd >= 0) ? 3 : 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            char buf[64];
+            while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+            {}
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (quit)
+            {
+                return;
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            // Only one client at a time, like a fresh compositor per client
+            if (client_fd >= 0)
+            {
+                close(client_fd);
+            }
+
+            client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            continue;
+        }
+
+        if ((client_fd >= 0) && (fds[2].revents & (POLLIN | POLLHUP)) && !handle_request())
+        {
+            close(client_fd);
+            client_fd = -1;
+        }
+
+        send_floods();
+    }
+}
+
+bool MockIPCServer::handle_request()
+{
+    uint32_t length;
+    if (!read_all(client_fd, &length, sizeof(length)))
+    {
+        return false;
+    }
+
+    std::string buf(length, 0);
+    if (!read_all(client_fd, buf.data(), length))
+    {
+        return false;
+    }
+
+    std::string method;
+    wf::json_t request;
+    if (!wf::json_t::parse_string(buf, request).has_value() && request.has_member("method"))
+    {
+        method = request["method"].as_string();
+    }
+
+    std::string response = "{\"result\": \"ok\"}";
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        request_counts[method]++;
+        auto it = responses.find(method);
+        if (it != responses.end())
+        {
+            response = it->second;
+        }
+    }
+
+    cond.notify_all();
+    return write_message(response);
+}
+
+void MockIPCServer::send_floods()
+{
+    std::deque<flood_t> pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.swap(floods);
+    }
+
+    if (client_fd < 0)
+    {
+        return;
+    }
+
+    for (auto& flood : pending)
+    {
+        wf::json_t event;
+        if (wf::json_t::parse_string(flood.event, event).has_value() || !event.is_object())
+        {
+            continue;
+        }
+
+        for (int i = 0; i < flood.count; i++)
+        {
+            event["sent-ns"] = now_ns();
+            if (!write_message(event.serialize()))
+            {
+                return;
+            }
+        }
+    }
+}
+
+bool MockIPCServer::write_message(const std::string& message)
+{
+    uint32_t length = message.size();
+    return write_all(client_fd, &length, sizeof(length)) &&
+           write_all(client_fd, message.data(), message.size());
+}
@@ -0,0 +1,75 @@
+#ifndef WF_IPC_MOCK_HPP
+#define WF_IPC_MOCK_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * A stand-in for the Wayfire IPC socket, for exercising WayfireIPC without a
+ * compositor.
+ *
+ * It listens on a Unix socket and speaks the same length-prefixed JSON
+ * protocol. Requests are answered in order with scripted responses, and
+ * floods of events can be sent at any time. The server runs on its own
+ * thread, so it can be driven from the same process as the client.
+ */
+class MockIPCServer
+{
+  public:
+    MockIPCServer(const std::string& socket_path);
+    ~MockIPCServer();
+
+    /* Answer requests for method with response. Other methods are answered
+     * with {"result": "ok"}. */
+    void set_response(const std::string& method, const std::string& response);
+
+    /**
+     * Send count copies of the event object to the connected client. Each
+     * copy gets a "sent-ns" member with the steady clock time it was sent at,
+     * in nanoseconds. Events which are not JSON objects are dropped.
+     */
+    void flood(const std::string& event, int count);
+
+    /* Number of requests received for method so far */
+    int get_request_count(const std::string& method);
+
+    /* Block until at least count requests for method were received */
+    void wait_for_requests(const std::string& method, int count);
+
+    /* Time of the steady clock in nanoseconds, as used for "sent-ns" */
+    static int64_t now_ns();
+
+  private:
+    struct flood_t
+    {
+        std::string event;
+        int count;
+    };
+
+    std::string socket_path;
+    int listen_fd = -1;
+    int client_fd = -1;
+    int wake_fds[2] = {-1, -1};
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::map<std::string, std::string> responses;
+    std::map<std::string, int> request_counts;
+    std::deque<flood_t> floods;
+    bool quit = false;
+
+    std::thread thread;
+
+    void run();
+    void wake();
+    bool handle_request();
+    void send_floods();
+    bool write_message(const std::string& message);
+};
+
+#endif /* end of include guard: WF_IPC_MOCK_HPP */
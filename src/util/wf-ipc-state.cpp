@@ -0,0 +1,328 @@
+#include <utility>
+#include <glibmm/main.h>
+#include <wayfire/util/log.hpp>
+
+#include "wf-ipc-state.hpp"
+
+/* Events each part of the model is built from. All view events carry the
+ * whole view, so the latest one of a view has all there is to know. */
+static const std::vector<std::string> keyboard_events = {
+    "keyboard-modifier-state-changed",
+};
+
+static const std::vector<std::string> output_events = {
+    "output-added",
+    "output-removed",
+    "wset-workspace-changed",
+};
+
+static const std::vector<std::string> view_events = {
+    "view-mapped",
+    "view-unmapped",
+    "view-set-output",
+    "view-geometry-changed",
+    "view-wset-changed",
+    "view-title-changed",
+    "view-app-id-changed",
+    "view-tiled",
+    "view-minimized",
+    "view-fullscreen",
+    "view-sticky",
+    "view-workspace-changed",
+};
+
+WayfireIPCState::WayfireIPCState()
+{
+    view_subscriber.state = this;
+    ipc_client = WayfireIPC::get_instance()->create_client();
+    ipc_client->subscribe(this, keyboard_events);
+    query_keyboard();
+}
+
+WayfireIPCState::~WayfireIPCState()
+{
+    notify_connection.disconnect();
+    ipc_client->unsubscribe(&view_subscriber);
+    ipc_client->unsubscribe(this);
+}
+
+std::shared_ptr<WayfireIPCState> WayfireIPCState::get_instance()
+{
+    static std::weak_ptr<WayfireIPCState> state;
+
+    auto instance = state.lock();
+    if (!instance)
+    {
+        instance = std::make_shared<WayfireIPCState>();
+        state    = instance;
+    }
+
+    return instance;
+}
+
+void WayfireIPCState::watch_views()
+{
+    if (watching_views)
+    {
+        return;
+    }
+
+    watching_views = true;
+    auto coalesce = IPCCoalescePolicy::once_per_frame({"view", "id"});
+    coalesce.by_name = false;
+    ipc_client->subscribe(&view_subscriber, view_events, coalesce);
+    // Focus changes are about two views, so they are never merged
+    ipc_client->subscribe(this, {"view-focused"});
+    query_views();
+}
+
+void WayfireIPCState::watch_outputs()
+{
+    if (watching_outputs)
+    {
+        return;
+    }
+
+    watching_outputs = true;
+    ipc_client->subscribe(this, output_events);
+    query_outputs();
+}
+
+/* Events between a query and its response are applied and then overwritten
+ * by the response, which is fine as they are sent in order. */
+void WayfireIPCState::query_views()
+{
+    ipc_client->send("{\"method\":\"window-rules/list-views\"}", [=] (const wf::json_t& data)
+    {
+        set_views(data);
+    });
+}
+
+void WayfireIPCState::query_outputs()
+{
+    ipc_client->send("{\"method\":\"window-rules/list-outputs\"}", [=] (const wf::json_t& data)
+    {
+        set_outputs(data);
+    });
+}
+
+void WayfireIPCState::query_keyboard()
+{
+    ipc_client->send("{\"method\":\"wayfire/get-keyboard-state\"}", [=] (const wf::json_t& data)
+    {
+        if (data.has_member("possible-layouts"))
+        {
+            keyboard = data;
+            keyboard_changed = true;
+            schedule_notify();
+        }
+    });
+}
+
+const std::map<int, wf::json_t>& WayfireIPCState::get_views()
+{
+    watch_views();
+    return views;
+}
+
+const std::map<int, wf::json_t>& WayfireIPCState::get_outputs()
+{
+    watch_outputs();
+    return outputs;
+}
+
+int WayfireIPCState::get_focused_view()
+{
+    watch_views();
+    return focused_view;
+}
+
+void WayfireIPCState::set_views(const wf::json_t& list)
+{
+    if (!list.is_array())
+    {
+        LOGE("IPC state: failed to list views: ", list.serialize());
+        return;
+    }
+
+    views.clear();
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        update_view(list[i]);
+    }
+
+    views_changed = true;
+    schedule_notify();
+}
+
+void WayfireIPCState::set_outputs(const wf::json_t& list)
+{
+    if (!list.is_array())
+    {
+        LOGE("IPC state: failed to list outputs: ", list.serialize());
+        return;
+    }
+
+    outputs.clear();
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        outputs[list[i]["id"].as_int()] = list[i];
+    }
+
+    outputs_changed = true;
+    schedule_notify();
+}
+
+void WayfireIPCState::update_view(const wf::json_t& view)
+{
+    if (view.is_object() && view.has_member("id"))
+    {
+        views[view["id"].as_int()] = view;
+    }
+}
+
+void WayfireIPCState::on_event(const wf::json_t& event)
+{
+    auto name = event["event"].as_string();
+    if (name == "keyboard-modifier-state-changed")
+    {
+        keyboard = event["state"];
+        keyboard_changed = true;
+    } else if (name == "output-added")
+    {
+        outputs[event["output"]["id"].as_int()] = event["output"];
+        outputs_changed = true;
+    } else if (name == "output-removed")
+    {
+        outputs.erase(event["output"]["id"].as_int());
+        outputs_changed = true;
+    } else if (name == "wset-workspace-changed")
+    {
+        // Only the output id is given, and -1 for workspace sets without one
+        auto it = outputs.end();
+        if (event.has_member("output") && event["output"].is_int())
+        {
+            it = outputs.find(event["output"].as_int());
+        }
+
+        if (it != outputs.end())
+        {
+            it->second["workspace"]["x"] = event["new-workspace"]["x"].as_int();
+            it->second["workspace"]["y"] = event["new-workspace"]["y"].as_int();
+            outputs_changed = true;
+        }
+    } else if (name == "view-focused")
+    {
+        /* The view itself is left to the view events, which may still hold
+         * back an update of it from before this one */
+        auto& view = event["view"];
+        focused_view = (view.is_object() && view.has_member("id")) ? view["id"].as_int() : -1;
+        if ((focused_view >= 0) && !views.count(focused_view))
+        {
+            update_view(view);
+        }
+
+        views_changed = true;
+    }
+
+    schedule_notify();
+}
+
+void WayfireIPCState::on_view_event(const wf::json_t& event)
+{
+    if (event["event"].as_string() == "view-unmapped")
+    {
+        if (event["view"].is_object())
+        {
+            int id = event["view"]["id"].as_int();
+            views.erase(id);
+            if (focused_view == id)
+            {
+                focused_view = -1;
+            }
+        }
+    } else
+    {
+        update_view(event["view"]);
+    }
+
+    views_changed = true;
+    schedule_notify();
+}
+
+void WayfireIPCState::on_reconnected()
+{
+    // Whatever happened in between was missed
+    query_keyboard();
+    if (watching_outputs)
+    {
+        query_outputs();
+    }
+
+    if (watching_views)
+    {
+        query_views();
+    }
+}
+
+std::vector<std::string> WayfireIPCState::get_event_fields()
+{
+    return {"view", "output", "new-workspace", "state"};
+}
+
+void WayfireIPCState::ViewSubscriber::on_event(const wf::json_t& event)
+{
+    state->on_view_event(event);
+}
+
+std::vector<std::string> WayfireIPCState::ViewSubscriber::get_event_fields()
+{
+    return {"view"};
+}
+
+void WayfireIPCState::schedule_notify()
+{
+    if (!notify_connection.connected())
+    {
+        notify_connection = Glib::signal_idle().connect([=] ()
+        {
+            notify();
+            return false;
+        });
+    }
+}
+
+void WayfireIPCState::notify()
+{
+    if (std::exchange(views_changed, false))
+    {
+        views_signal.emit();
+    }
+
+    if (std::exchange(outputs_changed, false))
+    {
+        outputs_signal.emit();
+    }
+
+    if (std::exchange(keyboard_changed, false))
+    {
+        keyboard_signal.emit();
+    }
+}
+
+sigc::signal<void()> WayfireIPCState::signal_views_changed()
+{
+    watch_views();
+    return views_signal;
+}
+
+sigc::signal<void()> WayfireIPCState::signal_outputs_changed()
+{
+    watch_outputs();
+    return outputs_signal;
+}
+
+sigc::signal<void()> WayfireIPCState::signal_keyboard_changed()
+{
+    return keyboard_signal;
+}
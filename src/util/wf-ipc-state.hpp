@@ -0,0 +1,98 @@
+#ifndef WF_IPC_STATE_HPP
+#define WF_IPC_STATE_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sigc++/connection.h>
+#include <sigc++/signal.h>
+#include <wayfire/nonstd/json.hpp>
+
+#include "wf-ipc.hpp"
+
+/**
+ * A model of the compositor state, shared by everything in the process which
+ * needs it.
+ *
+ * Each part of the model is queried when it is first read or connected to,
+ * and again on every reconnect, and kept up to date from events afterwards,
+ * so that widgets can read it whenever they like instead of each sending
+ * their own requests. Only keyboard state is watched from the start, views
+ * and outputs are not watched until somebody needs them. Views and outputs
+ * are kept in the form Wayfire reports them in, keyed by their id.
+ *
+ * View events come in bursts, for example while a view is dragged, so only
+ * the latest one per view and frame is applied. The change signals are
+ * emitted at most once per main loop iteration, after any number of updates.
+ */
+class WayfireIPCState : public IIPCSubscriber
+{
+  public:
+    WayfireIPCState();
+    ~WayfireIPCState();
+
+    const std::map<int, wf::json_t>& get_views();
+    const std::map<int, wf::json_t>& get_outputs();
+
+    /* As returned by wayfire/get-keyboard-state, null until it is known */
+    const wf::json_t& get_keyboard()
+    {
+        return keyboard;
+    }
+
+    /* Id of the focused view, -1 if none */
+    int get_focused_view();
+
+    sigc::signal<void()> signal_views_changed();
+    sigc::signal<void()> signal_outputs_changed();
+    sigc::signal<void()> signal_keyboard_changed();
+
+    void on_event(const wf::json_t& event) override;
+    void on_reconnected() override;
+    std::vector<std::string> get_event_fields() override;
+
+    static std::shared_ptr<WayfireIPCState> get_instance();
+
+  private:
+    /* View events are coalesced, so they go to a subscriber of their own */
+    class ViewSubscriber : public IIPCSubscriber
+    {
+      public:
+        WayfireIPCState *state;
+        void on_event(const wf::json_t& event) override;
+        std::vector<std::string> get_event_fields() override;
+    };
+
+    std::shared_ptr<IPCClient> ipc_client;
+    ViewSubscriber view_subscriber;
+    bool watching_views   = false;
+    bool watching_outputs = false;
+
+    std::map<int, wf::json_t> views;
+    std::map<int, wf::json_t> outputs;
+    wf::json_t keyboard;
+    int focused_view = -1;
+
+    bool views_changed    = false;
+    bool outputs_changed  = false;
+    bool keyboard_changed = false;
+    sigc::connection notify_connection;
+    sigc::signal<void()> views_signal;
+    sigc::signal<void()> outputs_signal;
+    sigc::signal<void()> keyboard_signal;
+
+    void watch_views();
+    void watch_outputs();
+    void query_views();
+    void query_outputs();
+    void query_keyboard();
+    void on_view_event(const wf::json_t& event);
+    void set_views(const wf::json_t& list);
+    void set_outputs(const wf::json_t& list);
+    void update_view(const wf::json_t& view);
+    void schedule_notify();
+    void notify();
+};
+
+#endif /* end of include guard: WF_IPC_STATE_HPP */
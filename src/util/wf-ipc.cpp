@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -19,7 +22,6 @@
 #include <wayfire/util/log.hpp>
 
 #include "wf-ipc.hpp"
-#include "giomm/cancellable.h"
 #include "giomm/error.h"
 #include "giomm/socketclient.h"
 #include "giomm/unixsocketaddress.h"
@@ -29,18 +31,54 @@
 #include "glibmm/main.h"
 #include "sigc++/functors/mem_fun.h"
 
+/* How much is read from the socket at once */
+#define READ_CHUNK_SIZE (64 * 1024)
+/* How much is read and handled before the main loop gets to run again, so
+ * that a flood of events does not keep it from drawing */
+#define READ_BYTES_PER_WAKEUP (256 * 1024)
+/* Anything longer means the stream is out of sync */
+#define MAX_MESSAGE_LENGTH (256 * 1024 * 1024)
+/* Bounds for the delay between reconnection attempts, it doubles after
+ * every failed attempt */
+#define RECONNECT_DELAY_MIN_MS 100
+#define RECONNECT_DELAY_MAX_MS 10000
+/* Wayfire treats a watch without events as a watch for all events. To stop
+ * receiving events entirely, we watch an event which is never emitted. */
+#define NO_EVENTS_PLACEHOLDER "wf-shell/no-events"
+
+static bool parse_message(std::string_view buf, wf::json_t& message)
+{
+    auto err = wf::json_t::parse_string(buf, message);
+    if (err.has_value())
+    {
+        /* The next message starts right after this one, so the
+         * stream is still usable */
+        LOGE("IPC error: JSON parse: ", err.value(), " message: ", buf, " length: ", buf.length());
+        return false;
+    }
+
+    return true;
+}
+
+/* A response in the form Wayfire reports errors in */
+static wf::json_t make_error_response(const std::string& message)
+{
+    wf::json_t error;
+    error["result"] = "error";
+    error["error"]  = message;
+    return error;
+}
+
 WayfireIPC::WayfireIPC()
 {
+    reconnect_delay = RECONNECT_DELAY_MIN_MS;
     connect();
-
-    sig_connection = Glib::signal_io().connect(
-        sigc::mem_fun(*this, &WayfireIPC::receive),
-        connection->get_socket()->get_fd(),
-        Glib::IOCondition::IO_IN);
+    watch_connection();
 }
 
 WayfireIPC::~WayfireIPC()
 {
+    watch_update_connection.disconnect();
     disconnect();
 }
 
@@ -56,98 +94,239 @@ void WayfireIPC::connect()
     auto address = Gio::UnixSocketAddress::create(socket_path);
     connection = client->connect(address);
     connection->get_socket()->set_blocking(false);
-    output = connection->get_output_stream();
-    input  = connection->get_input_stream();
-    cancel = Gio::Cancellable::create();
+}
+
+void WayfireIPC::watch_connection()
+{
+    read_connection = Glib::signal_io().connect(
+        sigc::mem_fun(*this, &WayfireIPC::receive),
+        connection->get_socket()->get_fd(),
+        Glib::IOCondition::IO_IN);
+
+    if (!write_queue.empty())
+    {
+        arm_write();
+    }
 }
 
 void WayfireIPC::disconnect()
 {
-    cancel->cancel();
-    sig_connection.disconnect();
-    connection->close();
+    read_connection.disconnect();
+    write_connection.disconnect();
+    reconnect_connection.disconnect();
+    if (connection)
+    {
+        connection->close();
+        connection.reset();
+    }
 }
 
-void WayfireIPC::send(const std::string& message)
+void WayfireIPC::handle_disconnect()
 {
-    send_message(message);
-    response_handlers.push(0);
+    disconnect();
+    reader = IPCFrameReader();
+    write_queue.clear();
+    write_offset = 0;
+
+    // Whatever was sent will never be answered
+    auto lost = std::move(pending_responses);
+    pending_responses.clear();
+    auto error = make_error_response("IPC connection lost");
+    for (auto& pending : lost)
+    {
+        auto client = clients.find(pending.client);
+        if (client != clients.end())
+        {
+            client->second->handle_response(pending.request, error);
+        }
+    }
+
+    schedule_reconnect();
 }
 
-void WayfireIPC::send(const std::string& message, int response_handler)
+void WayfireIPC::schedule_reconnect()
 {
-    send_message(message);
-    response_handlers.push(response_handler);
+    if (reconnect_connection.connected() || connection)
+    {
+        return;
+    }
+
+    LOGI("IPC: reconnecting in ", reconnect_delay, "ms");
+    reconnect_connection = Glib::signal_timeout().connect([=] ()
+    {
+        try_reconnect();
+        return false;
+    }, reconnect_delay);
+    reconnect_delay = std::min(reconnect_delay * 2, RECONNECT_DELAY_MAX_MS);
 }
 
-void WayfireIPC::send_message(const std::string& message)
+void WayfireIPC::try_reconnect()
+{
+    reconnect_connection.disconnect();
+    try {
+        connect();
+    } catch (const std::exception& e)
+    {
+        LOGE("IPC error: reconnect failed: ", e.what());
+        connection.reset();
+        schedule_reconnect();
+        return;
+    }
+
+    reconnect_delay = RECONNECT_DELAY_MIN_MS;
+    replay_subscriptions();
+    watch_connection();
+
+    // Subscribers missed whatever happened while disconnected
+    std::set<IIPCSubscriber*> notify = subscribers;
+    for (auto& [_, subs] : subscriptions)
+    {
+        notify.insert(subs.begin(), subs.end());
+    }
+
+    for (auto subscriber : notify)
+    {
+        // An earlier one may have unsubscribed and destroyed it
+        if (is_subscribed(subscriber))
+        {
+            subscriber->on_reconnected();
+        }
+    }
+}
+
+/* Whether subscriber gets the given event, or any event if name is empty */
+bool WayfireIPC::is_subscribed(IIPCSubscriber *subscriber, const std::string& name)
+{
+    if (subscribers.count(subscriber))
+    {
+        return true;
+    }
+
+    if (!name.empty())
+    {
+        auto it = subscriptions.find(name);
+        return (it != subscriptions.end()) && it->second.count(subscriber);
+    }
+
+    for (auto& [_, subs] : subscriptions)
+    {
+        if (subs.count(subscriber))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Ask the new compositor connection for the events we were watching. This
+ * goes in front of requests which were made while disconnected, so that the
+ * FIFO response matching stays intact. */
+void WayfireIPC::replay_subscriptions()
 {
-    if (output->has_pending())
+    if (!watching_all && watched_events.empty())
     {
-        write_queue.push(message);
-        write_next();
+        // A new connection does not get any events anyway
         return;
     }
 
-    // Shortcut: stream is not busy, no queue needed
-    write_stream(message);
+    write_queue.push_front(build_watch_message());
+    pending_responses.push_front({next_request_id++, 0});
+}
+
+/* Each watch request replaces the whole set of events Wayfire sends us, so
+ * the message always lists everything that is still needed */
+std::string WayfireIPC::build_watch_message()
+{
+    wf::json_t watch;
+    watch["method"] = "window-rules/events/watch";
+    if (!watching_all)
+    {
+        watch["events"] = wf::json_t::array();
+        for (auto& event : watched_events)
+        {
+            watch["events"].append(event);
+        }
+
+        if (watched_events.empty())
+        {
+            watch["events"].append(NO_EVENTS_PLACEHOLDER);
+        }
+    }
+
+    return watch.serialize();
+}
+
+void WayfireIPC::schedule_watch_update()
+{
+    // Widgets are usually created or destroyed in batches, send one update for all of them
+    if (!watch_update_connection.connected())
+    {
+        watch_update_connection = Glib::signal_idle().connect([=] ()
+        {
+            update_watch();
+            return false;
+        });
+    }
 }
 
-void WayfireIPC::write_next()
+void WayfireIPC::update_watch()
 {
-    if (writing || cancel->is_cancelled())
+    watch_update_connection.disconnect();
+
+    bool want_all = !subscribers.empty();
+    std::set<std::string> want_events;
+    if (!want_all)
+    {
+        for (auto& [event, subs] : subscriptions)
+        {
+            want_events.insert(event);
+        }
+    }
+
+    if ((want_all == watching_all) && (want_events == watched_events))
     {
         return;
     }
 
-    writing = true;
-    sig_connection = Glib::signal_io().connect(
-        sigc::mem_fun(*this, &WayfireIPC::send_queue),
-        connection->get_socket()->get_fd(),
-        Glib::IOCondition::IO_OUT);
+    watching_all   = want_all;
+    watched_events = std::move(want_events);
+    send(build_watch_message());
 }
 
-void WayfireIPC::write_stream(const std::string& message)
+void WayfireIPC::send(const std::string& message)
 {
-    try {
-        writing = true;
-        uint32_t length = message.size();
-        // Pointer to data must be valid until completely wrote and
-        // slot is called, as documented for write_all_async.
-        // So we pin it with a shared pointer, destroyed *after* slot is called.
-        auto all_data = std::make_shared<std::string>((char*)&length, 4);
-        *all_data += message;
-        output->write_all_async(all_data->data(), all_data->size(),
-            [this, all_data] (Glib::RefPtr<Gio::AsyncResult>& result)
-        {
-            try {
-                gsize written;
-                auto success = output->write_all_finish(result, written);
-                if (!success)
-                {
-                    LOGE("IPC error: write failed. Bytes written: ", written);
-                }
+    send(message, 0);
+}
 
-                this->writing = false;
-                if (!cancel->is_cancelled())
-                {
-                    write_next();
-                }
-            } catch (const Glib::Error& e)
-            {
-                if (e.code() == G_IO_ERROR_CANCELLED)
-                {
-                    // Intended behavior
-                    return;
-                } else
-                {
-                    LOGE("IPC error: write failed: ", e.what());
-                }
-            }
-        }, cancel);
-    } catch (const Gio::Error& e)
+uint64_t WayfireIPC::send(const std::string& message, int client)
+{
+    auto request = next_request_id++;
+    send_message(message);
+    pending_responses.push_back({request, client});
+    return request;
+}
+
+void WayfireIPC::send_message(const std::string& message)
+{
+    write_queue.push_back(message);
+
+    // While disconnected, messages are kept until the connection is back
+    if (connection)
     {
-        LOGE("IPC error: ", e.what());
+        arm_write();
+    }
+}
+
+void WayfireIPC::arm_write()
+{
+    // Everything sent until the socket is writable goes out in one batch
+    if (!write_connection.connected())
+    {
+        write_connection = Glib::signal_io().connect(
+            sigc::mem_fun(*this, &WayfireIPC::send_queue),
+            connection->get_socket()->get_fd(),
+            Glib::IOCondition::IO_OUT);
     }
 }
 
@@ -155,153 +334,312 @@ bool WayfireIPC::send_queue(Glib::IOCondition cond)
 {
     if (write_queue.empty())
     {
-        writing = false;
         return false;
     }
 
-    auto message = write_queue.front();
-    write_queue.pop();
+    size_t count = std::min<size_t>(write_queue.size(), IOV_MAX / 2);
+    write_headers.resize(count);
+    write_iov.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& message = write_queue[i];
+        write_headers[i] = message.size();
+        write_iov.push_back({&write_headers[i], sizeof(uint32_t)});
+        write_iov.push_back({(void*)message.data(), message.size()});
+    }
 
-    write_stream(message);
-    return false;
+    // Skip the part of the first message which was sent last time
+    size_t first = 0;
+    size_t skip  = write_offset;
+    while (skip >= write_iov[first].iov_len)
+    {
+        skip -= write_iov[first].iov_len;
+        first++;
+    }
+
+    write_iov[first].iov_base = (char*)write_iov[first].iov_base + skip;
+    write_iov[first].iov_len -= skip;
+
+    msghdr msg = {};
+    msg.msg_iov    = write_iov.data() + first;
+    msg.msg_iovlen = write_iov.size() - first;
+
+    ssize_t sent = sendmsg(connection->get_socket()->get_fd(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        {
+            return true;
+        }
+
+        LOGE("IPC error: write failed: ", strerror(errno));
+        handle_disconnect();
+        return false;
+    }
+
+    // Drop the messages which were sent completely
+    size_t done = write_offset + sent;
+    while (!write_queue.empty() && (done >= sizeof(uint32_t) + write_queue.front().size()))
+    {
+        done -= sizeof(uint32_t) + write_queue.front().size();
+        write_queue.pop_front();
+    }
+
+    write_offset = done;
+    return !write_queue.empty();
 }
 
 bool WayfireIPC::receive(Glib::IOCondition cond)
 {
-    try {
-        ssize_t received = 0;
-        uint32_t length;
+    int fd = connection->get_socket()->get_fd();
+    size_t received = 0;
+    while (true)
+    {
+        auto status = reader.fill(fd, received);
+        if (status == IPCFrameReader::READ_CLOSED)
+        {
+            LOGE("IPC error: Disconnected");
+            handle_disconnect();
+            return false;
+        }
 
-        // TODO: Input buffer can(?) contain incomplete message
-        while (connection->get_socket()->get_available_bytes() > 0)
+        if (status == IPCFrameReader::READ_ERROR)
         {
-            received = input->read(&length, sizeof(length));
-            if (received == -1)
-            {
-                LOGE("IPC error: Receive message length failed");
-                return false;
-            }
+            LOGE("IPC error: receive failed: ", strerror(errno));
+            handle_disconnect();
+            return false;
+        }
 
-            if (received == 0)
-            {
-                LOGE("IPC error: Disconnected");
-                return false;
-            }
+        std::string_view message;
+        while (reader.next(message))
+        {
+            handle_message(message);
+        }
 
-            if (received != sizeof(length))
-            {
-                LOGE("IPC error: failed to read message. Expected (bytes): ",
-                    sizeof(length),
-                    ", was read (bytes)",
-                    received);
-                return false;
-            }
+        if (reader.is_corrupt())
+        {
+            LOGE("IPC error: invalid message length, reconnecting");
+            handle_disconnect();
+            return false;
+        }
 
-            std::string buf(length, 0);
-            received = input->read(&buf[0], length);
-            if (received == -1)
-            {
-                LOGE("IPC error: receive message body failed");
-                return false;
-            }
+        // The rest is read once the main loop comes back to the socket
+        if ((status == IPCFrameReader::READ_WOULD_BLOCK) || (received >= READ_BYTES_PER_WAKEUP))
+        {
+            reader.compact();
+            return true;
+        }
+    }
+}
 
-            if (received == 0)
-            {
-                LOGE("IPC error: Disconnected");
-                return false;
-            }
+void WayfireIPC::handle_message(std::string_view buf)
+{
+    /* Events are routed by their name alone, so that they are parsed only if
+     * someone is interested in them, and only as far as needed */
+    std::string_view name;
+    if (peek.scan(buf) && peek.get_string("event", name))
+    {
+        handle_event(buf, std::string(name), nullptr);
+        return;
+    }
 
-            if (received != length)
-            {
-                LOGE("IPC error: failed to read message. Expected (bytes): ",
-                    length,
-                    ", was read (bytes)",
-                    received);
-                return false;
-            }
+    // Shared, so that coalesced events can be held back without a copy
+    auto parsed = std::make_shared<wf::json_t>();
+    wf::json_t& message = *parsed;
+    if (!parse_message(buf, message))
+    {
+        return;
+    }
 
-            wf::json_t message;
-            auto err = wf::json_t::parse_string(buf, message);
-            if (err.has_value())
-            {
-                LOGE("IPC error: JSON parse: ", err.value(), " message: ", buf, " length: ", buf.length());
-                return false;
-            }
+    if (message.has_member("event"))
+    {
+        handle_event(buf, message["event"].as_string(), parsed);
+    } else
+    {
+        if (pending_responses.empty())
+        {
+            LOGE("IPC error: response without a request: ", buf);
+            return;
+        }
+
+        auto pending = pending_responses.front();
+        pending_responses.pop_front();
+        auto client = clients.find(pending.client);
+        if (client != clients.end())
+        {
+            client->second->handle_response(pending.request, message);
+        }
+    }
+}
+
+void WayfireIPC::handle_event(std::string_view buf, const std::string& name,
+    std::shared_ptr<const wf::json_t> parsed)
+{
+    std::vector<IIPCSubscriber*> targets(subscribers.begin(), subscribers.end());
+    auto it = subscriptions.find(name);
+    if (it != subscriptions.end())
+    {
+        targets.insert(targets.end(), it->second.begin(), it->second.end());
+    }
+
+    if (targets.empty())
+    {
+        // Left over from before the last watch update
+        return;
+    }
+
+    if (!parsed)
+    {
+        parsed = parse_event(buf, name, targets);
+        if (!parsed)
+        {
+            return;
+        }
+    }
 
-            if (message.has_member("event"))
+    for (auto subscriber : targets)
+    {
+        /* Handlers may unsubscribe and destroy other subscribers, for
+         * example when a widget is reloaded */
+        if (is_subscribed(subscriber, name))
+        {
+            dispatch_event(subscriber, parsed);
+        }
+    }
+}
+
+/* Parse the members of an event which its subscribers need. peek has to
+ * hold the result of scanning buf. */
+std::shared_ptr<const wf::json_t> WayfireIPC::parse_event(std::string_view buf,
+    const std::string& name, const std::vector<IIPCSubscriber*>& targets)
+{
+    auto parsed = std::make_shared<wf::json_t>();
+    bool partial = std::all_of(targets.begin(), targets.end(), [&] (IIPCSubscriber *subscriber)
+    {
+        return event_fields.count(subscriber);
+    });
+
+    if (partial)
+    {
+        wf::json_t& event = *parsed;
+        event["event"] = name;
+        for (auto subscriber : targets)
+        {
+            for (auto& field : event_fields[subscriber])
             {
-                for (auto subscriber : subscribers)
+                auto raw = peek.get(field);
+                if (raw.empty() || event.has_member(field))
                 {
-                    subscriber->on_event(message);
+                    continue;
                 }
 
-                if (subscriptions.find(message["event"]) != subscriptions.end())
+                wf::json_t value;
+                if (wf::json_t::parse_string(raw, value).has_value())
                 {
-                    for (auto sub : subscriptions[message["event"]])
-                    {
-                        sub->on_event(message);
-                    }
-                }
-            } else
-            {
-                auto handler = response_handlers.front();
-                response_handlers.pop();
-                auto client = clients.find(handler);
-                if (client != clients.end())
-                {
-                    client->second->handle_response(message);
+                    // Parse everything, to report the error with the whole message
+                    partial = false;
+                    break;
                 }
+
+                event[field] = std::move(value);
             }
         }
-    } catch (const Gio::Error& e)
+    }
+
+    if (!partial)
     {
-        LOGE("IPC error: ", e.what());
-        return false;
+        *parsed = wf::json_t();
+        if (!parse_message(buf, *parsed))
+        {
+            return nullptr;
+        }
     }
 
-    return true;
+    return parsed;
 }
 
-void WayfireIPC::subscribe_all(IIPCSubscriber *subscriber)
+void WayfireIPC::dispatch_event(IIPCSubscriber *subscriber,
+    const std::shared_ptr<const wf::json_t>& event)
 {
-    subscribers.insert(subscriber);
-
-    wf::json_t new_subs;
-    new_subs["method"] = "window-rules/events/watch";
-    send(new_subs.serialize());
+    auto it = coalescers.find(subscriber);
+    if (it != coalescers.end())
+    {
+        it->second->push(event);
+    } else
+    {
+        subscriber->on_event(*event);
+    }
 }
 
-void WayfireIPC::subscribe(IIPCSubscriber *subscriber, const std::vector<std::string>& events)
+/* The policy applies to all events of the subscriber, so it is set by the
+ * first subscription, and later ones have to agree with it */
+void WayfireIPC::set_coalesce_policy(IIPCSubscriber *subscriber, const IPCCoalescePolicy& coalesce)
 {
-    wf::json_t new_subs;
-    new_subs["method"] = "window-rules/events/watch";
-    new_subs["events"] = wf::json_t::array();
-
-    for (auto event : events)
+    if (is_subscribed(subscriber))
     {
-        if (subscriptions.find(event) == subscriptions.end())
+        auto it = coalescers.find(subscriber);
+        auto current = (it != coalescers.end()) ? it->second->get_policy() : IPCCoalescePolicy{};
+        if (!(current == coalesce))
         {
-            new_subs["events"].append(event);
-            subscriptions[event] = std::set<IIPCSubscriber*>();
+            LOGE("IPC: subscriber already has a different coalescing policy, keeping it");
         }
 
-        subscriptions[event].insert(subscriber);
+        return;
     }
 
-    if (new_subs["events"].size() > 0)
+    if (coalesce.interval_ms > 0)
     {
-        send(new_subs.serialize());
+        coalescers[subscriber] = std::make_unique<IPCEventCoalescer>(subscriber, coalesce);
     }
 }
 
+void WayfireIPC::set_event_fields(IIPCSubscriber *subscriber)
+{
+    auto fields = subscriber->get_event_fields();
+    if (fields.empty())
+    {
+        event_fields.erase(subscriber);
+    } else
+    {
+        event_fields[subscriber] = std::move(fields);
+    }
+}
+
+void WayfireIPC::subscribe_all(IIPCSubscriber *subscriber, const IPCCoalescePolicy& coalesce)
+{
+    set_coalesce_policy(subscriber, coalesce);
+    subscribers.insert(subscriber);
+    set_event_fields(subscriber);
+    schedule_watch_update();
+}
+
+void WayfireIPC::subscribe(IIPCSubscriber *subscriber, const std::vector<std::string>& events,
+    const IPCCoalescePolicy& coalesce)
+{
+    set_coalesce_policy(subscriber, coalesce);
+    set_event_fields(subscriber);
+    for (auto& event : events)
+    {
+        subscriptions[event].insert(subscriber);
+    }
+
+    schedule_watch_update();
+}
+
 void WayfireIPC::unsubscribe(IIPCSubscriber *subscriber)
 {
     subscribers.erase(subscriber);
+    coalescers.erase(subscriber);
+    event_fields.erase(subscriber);
 
-    for (auto& [_, subs] : subscriptions)
+    // Events are watched for as long as anyone is subscribed to them
+    for (auto it = subscriptions.begin(); it != subscriptions.end();)
     {
-        subs.erase(subscriber);
+        it->second.erase(subscriber);
+        it = it->second.empty() ? subscriptions.erase(it) : std::next(it);
     }
+
+    schedule_watch_update();
 }
 
 std::shared_ptr<IPCClient> WayfireIPC::create_client()
@@ -340,6 +678,11 @@ std::shared_ptr<WayfireIPC> WayfireIPC::get_instance()
 // IPCClient
 IPCClient::~IPCClient()
 {
+    for (auto& [_, request] : requests)
+    {
+        request.timeout.disconnect();
+    }
+
     ipc->client_destroyed(id);
 }
 
@@ -348,30 +691,469 @@ void IPCClient::send(const std::string& message)
     ipc->send(message);
 }
 
-void IPCClient::send(const std::string& message, response_handler cb)
+uint64_t IPCClient::send(const std::string& message, response_handler cb, int timeout_ms)
+{
+    auto request = ipc->send(message, id);
+    requests[request].handler = cb;
+    if (timeout_ms > 0)
+    {
+        requests[request].timeout = Glib::signal_timeout().connect([=] ()
+        {
+            handle_timeout(request);
+            return false;
+        }, timeout_ms);
+    }
+
+    return request;
+}
+
+void IPCClient::send_all(const std::vector<std::string>& messages, responses_handler cb, int timeout_ms)
+{
+    if (messages.empty())
+    {
+        cb({});
+        return;
+    }
+
+    struct batch_t
+    {
+        std::vector<wf::json_t> responses;
+        size_t remaining;
+    };
+
+    auto batch = std::make_shared<batch_t>();
+    batch->responses.resize(messages.size());
+    batch->remaining = messages.size();
+    for (size_t i = 0; i < messages.size(); i++)
+    {
+        send(messages[i], [=] (const wf::json_t& response)
+        {
+            batch->responses[i] = response;
+            if (--batch->remaining == 0)
+            {
+                cb(batch->responses);
+            }
+        }, timeout_ms);
+    }
+}
+
+void IPCClient::cancel(uint64_t request)
 {
-    response_handlers.push(cb);
-    ipc->send(message, id);
+    auto it = requests.find(request);
+    if (it != requests.end())
+    {
+        it->second.timeout.disconnect();
+        requests.erase(it);
+    }
 }
 
-void IPCClient::handle_response(wf::json_t response)
+void IPCClient::handle_response(uint64_t request, const wf::json_t& response)
 {
-    auto handler = response_handlers.front();
-    response_handlers.pop();
+    auto it = requests.find(request);
+    if (it == requests.end())
+    {
+        // Cancelled or timed out
+        return;
+    }
+
+    auto handler = std::move(it->second.handler);
+    it->second.timeout.disconnect();
+    requests.erase(it);
     handler(response);
 }
 
-void IPCClient::subscribe(IIPCSubscriber *subscriber, const std::vector<std::string>& events)
+void IPCClient::handle_timeout(uint64_t request)
 {
-    ipc->subscribe(subscriber, events);
+    auto it = requests.find(request);
+    if (it == requests.end())
+    {
+        return;
+    }
+
+    auto handler = std::move(it->second.handler);
+    requests.erase(it);
+    handler(make_error_response("IPC request timed out"));
 }
 
-void IPCClient::subscribe_all(IIPCSubscriber *subscriber)
+void IPCClient::subscribe(IIPCSubscriber *subscriber, const std::vector<std::string>& events,
+    const IPCCoalescePolicy& coalesce)
 {
-    ipc->subscribe_all(subscriber);
+    ipc->subscribe(subscriber, events, coalesce);
+}
+
+void IPCClient::subscribe_all(IIPCSubscriber *subscriber, const IPCCoalescePolicy& coalesce)
+{
+    ipc->subscribe_all(subscriber, coalesce);
 }
 
 void IPCClient::unsubscribe(IIPCSubscriber *subscriber)
 {
     ipc->unsubscribe(subscriber);
 }
+
+// IPCEventCoalescer
+IPCEventCoalescer::IPCEventCoalescer(IIPCSubscriber *subscriber, const IPCCoalescePolicy& policy)
+{
+    this->subscriber = subscriber;
+    this->policy     = policy;
+}
+
+IPCEventCoalescer::~IPCEventCoalescer()
+{
+    *alive = false;
+    timer.disconnect();
+}
+
+std::string IPCEventCoalescer::get_key(const wf::json_t& event)
+{
+    std::string name = policy.by_name ? event["event"].as_string() : "";
+
+    // Without a key, only the latest event of each name is kept
+    if (policy.key.empty())
+    {
+        return name;
+    }
+
+    std::function<std::string (const wf::json_t&, size_t)> lookup;
+    lookup = [&] (const wf::json_t& node, size_t depth) -> std::string
+    {
+        if (depth == policy.key.size())
+        {
+            return node.serialize();
+        }
+
+        if (!node.is_object() || !node.has_member(policy.key[depth]))
+        {
+            return "";
+        }
+
+        return lookup(node[policy.key[depth]], depth + 1);
+    };
+
+    return name + "/" + lookup(event, 0);
+}
+
+void IPCEventCoalescer::push(const std::shared_ptr<const wf::json_t>& event)
+{
+    if (!timer.connected())
+    {
+        // Start of a burst
+        timer = Glib::signal_timeout().connect(
+            sigc::mem_fun(*this, &IPCEventCoalescer::flush), policy.interval_ms);
+        subscriber->on_event(*event);
+        return;
+    }
+
+    auto key = get_key(*event);
+    auto it  = queued_keys.find(key);
+    if (it != queued_keys.end())
+    {
+        queued[it->second] = event;
+    } else
+    {
+        queued_keys[key] = queued.size();
+        queued.push_back(event);
+    }
+}
+
+bool IPCEventCoalescer::flush()
+{
+    if (queued.empty())
+    {
+        // The burst is over
+        return false;
+    }
+
+    // The subscriber may unsubscribe and destroy this from on_event()
+    auto events = std::move(queued);
+    auto target = subscriber;
+    auto still_alive = alive;
+    queued.clear();
+    queued_keys.clear();
+    for (auto& event : events)
+    {
+        if (!*still_alive)
+        {
+            return false;
+        }
+
+        target->on_event(*event);
+    }
+
+    return true;
+}
+
+// IPCFrameReader
+IPCFrameReader::read_status_t IPCFrameReader::fill(int fd, size_t& received_total)
+{
+    if (start == end)
+    {
+        start = end = 0;
+    }
+
+    /* Make room for at least a chunk, or for the rest of the current
+     * message if it is longer. Consumed data is dropped first, so the
+     * buffer only grows for messages larger than it. */
+    size_t needed = std::clamp<size_t>(pending_length(), READ_CHUNK_SIZE,
+        sizeof(uint32_t) + MAX_MESSAGE_LENGTH);
+    if (buffer.size() - end < needed)
+    {
+        if (start > 0)
+        {
+            std::memmove(buffer.data(), buffer.data() + start, end - start);
+            end  -= start;
+            start = 0;
+        }
+
+        if (buffer.size() - end < needed)
+        {
+            buffer.resize(end + needed);
+        }
+    }
+
+    while (true)
+    {
+        ssize_t received = recv(fd, buffer.data() + end, buffer.size() - end, MSG_DONTWAIT);
+        if (received > 0)
+        {
+            end += received;
+            received_total += received;
+            return READ_DATA;
+        }
+
+        if (received == 0)
+        {
+            return READ_CLOSED;
+        }
+
+        if (errno == EINTR)
+        {
+            continue;
+        }
+
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? READ_WOULD_BLOCK : READ_ERROR;
+    }
+}
+
+void IPCFrameReader::compact()
+{
+    if (start != end)
+    {
+        return;
+    }
+
+    start = end = 0;
+    if (buffer.size() > READ_CHUNK_SIZE)
+    {
+        buffer.resize(READ_CHUNK_SIZE);
+        buffer.shrink_to_fit();
+    }
+}
+
+size_t IPCFrameReader::pending_length()
+{
+    uint32_t length;
+    if (end - start < sizeof(length))
+    {
+        return 0;
+    }
+
+    std::memcpy(&length, buffer.data() + start, sizeof(length));
+    return sizeof(length) + length;
+}
+
+bool IPCFrameReader::next(std::string_view& message)
+{
+    size_t length = pending_length();
+    if (length > sizeof(uint32_t) + MAX_MESSAGE_LENGTH)
+    {
+        corrupt = true;
+        return false;
+    }
+
+    if (!length || (end - start < length))
+    {
+        return false;
+    }
+
+    message = std::string_view(buffer.data() + start + sizeof(uint32_t), length - sizeof(uint32_t));
+    start  += length;
+    return true;
+}
+
+// IPCMessagePeek
+static bool is_json_space(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+static void skip_whitespace(std::string_view text, size_t& pos)
+{
+    while ((pos < text.size()) && is_json_space(text[pos]))
+    {
+        pos++;
+    }
+}
+
+static bool skip_string(std::string_view text, size_t& pos)
+{
+    for (pos++; pos < text.size(); pos++)
+    {
+        if (text[pos] == '\\')
+        {
+            pos++;
+        } else if (text[pos] == '"')
+        {
+            pos++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool skip_value(std::string_view text, size_t& pos)
+{
+    if (pos >= text.size())
+    {
+        return false;
+    }
+
+    if (text[pos] == '"')
+    {
+        return skip_string(text, pos);
+    }
+
+    if ((text[pos] == '{') || (text[pos] == '['))
+    {
+        int depth = 0;
+        while (pos < text.size())
+        {
+            char c = text[pos];
+            if (c == '"')
+            {
+                if (!skip_string(text, pos))
+                {
+                    return false;
+                }
+
+                continue;
+            }
+
+            if ((c == '{') || (c == '['))
+            {
+                depth++;
+            } else if (((c == '}') || (c == ']')) && (--depth == 0))
+            {
+                pos++;
+                return true;
+            }
+
+            pos++;
+        }
+
+        return false;
+    }
+
+    // A number, true, false or null
+    size_t start = pos;
+    while ((pos < text.size()) && !is_json_space(text[pos]) &&
+           (text[pos] != ',') && (text[pos] != '}') && (text[pos] != ']'))
+    {
+        pos++;
+    }
+
+    return pos > start;
+}
+
+bool IPCMessagePeek::scan(std::string_view message)
+{
+    members.clear();
+
+    size_t pos = 0;
+    skip_whitespace(message, pos);
+    if ((pos >= message.size()) || (message[pos] != '{'))
+    {
+        return false;
+    }
+
+    pos++;
+    skip_whitespace(message, pos);
+    if ((pos < message.size()) && (message[pos] == '}'))
+    {
+        return true;
+    }
+
+    while (pos < message.size())
+    {
+        size_t key_start = pos;
+        if ((message[pos] != '"') || !skip_string(message, pos))
+        {
+            return false;
+        }
+
+        auto key = message.substr(key_start + 1, pos - key_start - 2);
+        if (key.find('\\') != std::string_view::npos)
+        {
+            return false;
+        }
+
+        skip_whitespace(message, pos);
+        if ((pos >= message.size()) || (message[pos] != ':'))
+        {
+            return false;
+        }
+
+        pos++;
+        skip_whitespace(message, pos);
+        size_t value_start = pos;
+        if (!skip_value(message, pos))
+        {
+            return false;
+        }
+
+        members.emplace_back(key, message.substr(value_start, pos - value_start));
+
+        skip_whitespace(message, pos);
+        if ((pos < message.size()) && (message[pos] == '}'))
+        {
+            return true;
+        }
+
+        if ((pos >= message.size()) || (message[pos] != ','))
+        {
+            return false;
+        }
+
+        pos++;
+        skip_whitespace(message, pos);
+    }
+
+    return false;
+}
+
+std::string_view IPCMessagePeek::get(std::string_view key) const
+{
+    for (auto& [name, value] : members)
+    {
+        if (name == key)
+        {
+            return value;
+        }
+    }
+
+    return {};
+}
+
+bool IPCMessagePeek::get_string(std::string_view key, std::string_view& value) const
+{
+    auto raw = get(key);
+    if ((raw.size() < 2) || (raw.front() != '"') ||
+        (raw.find('\\') != std::string_view::npos))
+    {
+        return false;
+    }
+
+    value = raw.substr(1, raw.size() - 2);
+    return true;
+}
@@ -1,77 +1,327 @@
 #ifndef WF_IPC_HPP
 #define WF_IPC_HPP
 
-#include "giomm/cancellable.h"
-#include "giomm/outputstream.h"
 #include "giomm/socketconnection.h"
 #include "glibmm/iochannel.h"
 #include "glibmm/refptr.h"
 #include <wayfire/nonstd/json.hpp>
 #include "sigc++/connection.h"
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <map>
 #include <memory>
-#include <queue>
 #include <set>
 #include <string>
+#include <string_view>
+#include <sys/uio.h>
 #include <unordered_map>
 #include <vector>
 
 class IIPCSubscriber
 {
   public:
-    virtual void on_event(wf::json_t) = 0;
+    /* All subscribers of an event get the same message, which must not
+     * be modified or kept beyond the call */
+    virtual void on_event(const wf::json_t& event) = 0;
+
+    /* The connection to Wayfire was lost and is back. Subscriptions are
+     * restored already, but events in between were missed, so any state
+     * derived from them should be queried again. */
+    virtual void on_reconnected()
+    {}
+
+    /* Top-level members of events which on_event() reads, queried once on
+     * subscribing. Other members are not parsed if no subscriber of the
+     * event needs them, but may still be there. "event" is always there,
+     * the first member of a coalescing key has to be listed. Empty means
+     * all members. */
+    virtual std::vector<std::string> get_event_fields()
+    {
+        return {};
+    }
+};
+
+/**
+ * How events are delivered to a subscriber. By default every event is passed
+ * on as soon as it arrives. Subscribers which only care about the latest
+ * state, for example of a view's geometry while it is dragged, can have
+ * bursts of events merged instead.
+ */
+struct IPCCoalescePolicy
+{
+    /* Events arriving within this many ms after an event was delivered are
+     * held back and delivered together at the end of the interval. 0 means
+     * no coalescing. */
+    int interval_ms = 0;
+
+    /* Path of the member identifying what an event is about, for example
+     * {"view", "id"}. Of the held back events, only the latest one per
+     * event name and key is delivered. Empty means per event name. */
+    std::vector<std::string> key;
+
+    /* Whether events of different names are told apart. If not, only the
+     * latest event per key is delivered, whatever its name, for events which
+     * all carry the whole state of what the key names. */
+    bool by_name = true;
+
+    /* Keep only the latest event per key within interval_ms */
+    static IPCCoalescePolicy latest_per_key(int interval_ms, std::vector<std::string> key)
+    {
+        return {interval_ms, key};
+    }
+
+    bool operator ==(const IPCCoalescePolicy& other) const
+    {
+        return (interval_ms == other.interval_ms) && (key == other.key) && (by_name == other.by_name);
+    }
+
+    /* Deliver events at most once per frame (at 60Hz) */
+    static IPCCoalescePolicy once_per_frame(std::vector<std::string> key = {})
+    {
+        return {1000 / 60, key};
+    }
+};
+
+/**
+ * Holds back events for a subscriber according to its coalescing policy.
+ * The first event of a burst is delivered right away, the rest is merged
+ * and delivered once per interval until the burst is over.
+ */
+class IPCEventCoalescer
+{
+  public:
+    IPCEventCoalescer(IIPCSubscriber *subscriber, const IPCCoalescePolicy& policy);
+    ~IPCEventCoalescer();
+
+    void push(const std::shared_ptr<const wf::json_t>& event);
+
+    const IPCCoalescePolicy& get_policy()
+    {
+        return policy;
+    }
+
+  private:
+    IIPCSubscriber *subscriber;
+    IPCCoalescePolicy policy;
+    sigc::connection timer;
+    std::shared_ptr<bool> alive = std::make_shared<bool>(true);
+
+    /* Held back events in the order they first arrived, and their index
+     * by key */
+    std::vector<std::shared_ptr<const wf::json_t>> queued;
+    std::unordered_map<std::string, size_t> queued_keys;
+
+    std::string get_key(const wf::json_t& event);
+    bool flush();
 };
 
-using response_handler = std::function<void (wf::json_t)>;
+using response_handler = std::function<void (const wf::json_t&)>;
+using responses_handler = std::function<void (const std::vector<wf::json_t>&)>;
 
 class WayfireIPC;
 class IPCClient
 {
+    struct request_t
+    {
+        response_handler handler;
+        sigc::connection timeout;
+    };
+
     int id;
     std::shared_ptr<WayfireIPC> ipc;
-    std::queue<response_handler> response_handlers;
+    std::map<uint64_t, request_t> requests;
+
+    void handle_timeout(uint64_t request);
 
   public:
     IPCClient(int id, std::shared_ptr<WayfireIPC> ipc) : id(id), ipc(ipc)
     {}
     ~IPCClient();
     int get_id();
-    void handle_response(wf::json_t response);
+    void handle_response(uint64_t request, const wf::json_t& response);
     void send(const std::string& message);
-    void send(const std::string& message, response_handler cb);
-    void subscribe(IIPCSubscriber *subscriber, const std::vector<std::string>& events);
-    void subscribe_all(IIPCSubscriber *subscriber);
+
+    /**
+     * Send a request and call cb with the response. If timeout_ms is set and
+     * there is no response in time, cb gets an error response instead, in
+     * the same form as errors reported by Wayfire:
+     * {"result": "error", "error": "..."}
+     *
+     * @return An id which can be passed to cancel().
+     */
+    uint64_t send(const std::string& message, response_handler cb, int timeout_ms = 0);
+
+    /**
+     * Send all requests at once and call cb with their responses, in the
+     * order of the messages, once all of them are there.
+     */
+    void send_all(const std::vector<std::string>& messages, responses_handler cb, int timeout_ms = 0);
+
+    /* Drop the handler of a request which is still waiting for a response */
+    void cancel(uint64_t request);
+
+    /* Subscriptions can be added to over several calls. The coalescing
+     * policy covers all events of a subscriber and is set by the first call,
+     * later calls with a different one are refused with an error. */
+    void subscribe(IIPCSubscriber *subscriber, const std::vector<std::string>& events,
+        const IPCCoalescePolicy& coalesce = {});
+    void subscribe_all(IIPCSubscriber *subscriber, const IPCCoalescePolicy& coalesce = {});
     void unsubscribe(IIPCSubscriber *subscriber);
 };
 
+/**
+ * Splits the byte stream from the compositor into length-prefixed messages.
+ *
+ * Whatever the socket has available is read into a buffer which is kept
+ * across wakeups, so a message may arrive in any number of pieces. Complete
+ * messages are handed out as views into the buffer, without copying them.
+ */
+class IPCFrameReader
+{
+  public:
+    enum read_status_t
+    {
+        READ_DATA,
+        READ_WOULD_BLOCK,
+        READ_CLOSED,
+        READ_ERROR,
+    };
+
+    /* Read once from the non-blocking socket fd, adding the number of
+     * bytes read to received */
+    read_status_t fill(int fd, size_t& received);
+
+    /**
+     * Get the next complete message. The view is only valid until the next
+     * call to fill().
+     *
+     * @return false if there is no complete message, or if the stream is
+     * corrupt, see is_corrupt().
+     */
+    bool next(std::string_view& message);
+
+    /* Give back the memory of a large message once everything read is
+     * handled. Views into the buffer are not valid anymore afterwards. */
+    void compact();
+
+    /* The stream announced a message which is too long to be real */
+    bool is_corrupt()
+    {
+        return corrupt;
+    }
+
+  private:
+    std::vector<char> buffer;
+    /* Unread data is buffer[start, end) */
+    size_t start = 0;
+    size_t end   = 0;
+    bool corrupt = false;
+
+    /* Length of the message at start, 0 if its header is incomplete */
+    size_t pending_length();
+};
+
+/**
+ * Finds the top-level members of a JSON object without parsing their values,
+ * so that a message can be routed, or parsed only in part, cheaply.
+ *
+ * This is not a validator. Anything unusual makes scan() fail, and the
+ * message has to be parsed in full, which reports any error properly.
+ */
+class IPCMessagePeek
+{
+  public:
+    /* The views into message are valid for as long as message is */
+    bool scan(std::string_view message);
+
+    /* Raw JSON text of a top-level member, empty if there is none */
+    std::string_view get(std::string_view key) const;
+
+    /* Contents of a top-level string member without escape sequences */
+    bool get_string(std::string_view key, std::string_view& value) const;
+
+  private:
+    std::vector<std::pair<std::string_view, std::string_view>> members;
+};
+
 class WayfireIPC : public std::enable_shared_from_this<WayfireIPC>
 {
-    std::queue<int> response_handlers;
+    /* Wayfire answers requests in order and without any id, so responses
+     * are matched to the sent requests in FIFO order. Cancelled or timed
+     * out requests stay in the queue until their response arrives, which
+     * is then dropped. */
+    struct pending_response_t
+    {
+        uint64_t request;
+        int client;
+    };
+
+    std::deque<pending_response_t> pending_responses;
+    uint64_t next_request_id = 1;
     std::set<IIPCSubscriber*> subscribers;
     std::unordered_map<std::string, std::set<IIPCSubscriber*>> subscriptions;
+    std::unordered_map<IIPCSubscriber*, std::unique_ptr<IPCEventCoalescer>> coalescers;
+    /* Event fields of subscribers which do not need all of them */
+    std::unordered_map<IIPCSubscriber*, std::vector<std::string>> event_fields;
+    IPCMessagePeek peek;
+
+    /* The events Wayfire was last asked to send us. It is brought in line
+     * with the subscriptions once per main loop iteration. */
+    bool watching_all = false;
+    std::set<std::string> watched_events;
+    sigc::connection watch_update_connection;
     int next_client_id{1};
     std::unordered_map<int, IPCClient*> clients;
-    sigc::connection sig_connection;
+    sigc::connection read_connection;
+    sigc::connection write_connection;
     Glib::RefPtr<Gio::SocketConnection> connection;
-    Glib::RefPtr<Gio::InputStream> input;
-    Glib::RefPtr<Gio::OutputStream> output;
-    Glib::RefPtr<Gio::Cancellable> cancel;
-    std::queue<std::string> write_queue;
-    bool writing = false;
+    IPCFrameReader reader;
+
+    /* When the connection is lost, it is re-established with exponential
+     * backoff. Requests made in between are sent once it is back. */
+    sigc::connection reconnect_connection;
+    int reconnect_delay;
+
+    /* Messages waiting to be sent, and how much of the first one was sent
+     * already. Everything queued is sent with a single sendmsg() once the
+     * socket is writable, the length headers and the iovec array are kept
+     * around for the next batch. */
+    std::deque<std::string> write_queue;
+    size_t write_offset = 0;
+    std::vector<uint32_t> write_headers;
+    std::vector<iovec> write_iov;
 
     void connect();
     void disconnect();
+    void watch_connection();
+    void handle_disconnect();
+    void schedule_reconnect();
+    void try_reconnect();
+    void replay_subscriptions();
+    std::string build_watch_message();
+    void schedule_watch_update();
+    void update_watch();
     void send_message(const std::string& message);
+    void arm_write();
     bool send_queue(Glib::IOCondition cond);
     bool receive(Glib::IOCondition cond);
-    void write_stream(const std::string& message);
-    void write_next();
+    void handle_message(std::string_view buf);
+    bool is_subscribed(IIPCSubscriber *subscriber, const std::string& name = "");
+    void handle_event(std::string_view buf, const std::string& name,
+        std::shared_ptr<const wf::json_t> parsed);
+    std::shared_ptr<const wf::json_t> parse_event(std::string_view buf, const std::string& name,
+        const std::vector<IIPCSubscriber*>& targets);
+    void set_event_fields(IIPCSubscriber *subscriber);
+    void dispatch_event(IIPCSubscriber *subscriber, const std::shared_ptr<const wf::json_t>& event);
+    void set_coalesce_policy(IIPCSubscriber *subscriber, const IPCCoalescePolicy& coalesce);
 
   public:
     void send(const std::string& message);
-    void send(const std::string& message, int response_handler);
-    void subscribe(IIPCSubscriber *subscriber, const std::vector<std::string>& events);
-    void subscribe_all(IIPCSubscriber *subscriber);
+    uint64_t send(const std::string& message, int client);
+    void subscribe(IIPCSubscriber *subscriber, const std::vector<std::string>& events,
+        const IPCCoalescePolicy& coalesce = {});
+    void subscribe_all(IIPCSubscriber *subscriber, const IPCCoalescePolicy& coalesce = {});
     void unsubscribe(IIPCSubscriber *subscriber);
     std::shared_ptr<IPCClient> create_client();
     void client_destroyed(int id);
@@ -7,8 +7,11 @@
 #include <filesystem>
 #include <memory>
 #include <wayfire/config/file.hpp>
+#include <wayfire/config/compound-option.hpp>
 #include <wf-option-wrap.hpp>
 #include <gtk-utils.hpp>
+#include <wf-trace.hpp>
+#include <wf-watchdog.hpp>
 
 #include <unistd.h>
 
@@ -58,11 +61,15 @@ std::string WayfireShellApp::get_css_config_dir()
     return css_directory;
 }
 
+static std::string get_default_css()
+{
+    return (std::string)RESOURCEDIR + "/css/default.css";
+}
+
 void WayfireShellApp::on_css_reload()
 {
-    clear_css_rules();
     /* Add our defaults */
-    add_css_file((std::string)RESOURCEDIR + "/css/default.css", GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+    add_css_file(get_default_css(), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
     /* Add user directory */
     std::string ext(".css");
     for (auto & p : std::filesystem::directory_iterator(get_css_config_dir()))
@@ -74,40 +81,91 @@ void WayfireShellApp::on_css_reload()
     }
 
     /* Add one user file */
-    auto custom_css_config = WfOption<std::string>{"panel/css_path"};
-    std::string custom_css = custom_css_config;
-    if (custom_css != "")
+    set_custom_css((std::string)*css_path);
+}
+
+/* Replace the stylesheet from panel/css_path, and watch its directory so
+ * that it is reloaded when it changes */
+void WayfireShellApp::set_custom_css(const std::string& file)
+{
+    std::string path = file.empty() ? "" :
+        std::filesystem::absolute(file).lexically_normal().string();
+    if (path == custom_css)
+    {
+        return;
+    }
+
+    /* The old file stays if it is loaded for another reason too */
+    auto old_file   = std::filesystem::path(custom_css);
+    bool in_css_dir = (old_file.extension() == ".css") &&
+        ((std::filesystem::path(get_css_config_dir()) / old_file.filename()).string() == custom_css);
+    if (!custom_css.empty() && (custom_css != get_default_css()) && !in_css_dir)
+    {
+        remove_css_file(custom_css);
+    }
+
+    custom_css = path;
+    if (!custom_css.empty())
     {
         add_css_file(custom_css, GTK_STYLE_PROVIDER_PRIORITY_USER);
+        watch_css_dir(std::filesystem::path(custom_css).parent_path());
     }
 }
 
 void WayfireShellApp::clear_css_rules()
 {
     auto display = Gdk::Display::get_default();
-    for (auto css_provider : css_rules)
+    for (auto& [_, css_provider] : css_files)
     {
         Gtk::StyleContext::remove_provider_for_display(display, css_provider);
     }
 
-    css_rules.clear();
+    css_files.clear();
 }
 
 void WayfireShellApp::add_css_file(std::string file, int priority)
 {
     auto display = Gdk::Display::get_default();
-    if (file != "")
+    if ((file != "") && !css_files.count(file))
     {
         auto css_provider = load_css_from_path(file);
         if (css_provider)
         {
             Gtk::StyleContext::add_provider_for_display(
                 display, css_provider, GTK_STYLE_PROVIDER_PRIORITY_USER);
-            css_rules.push_back(css_provider);
+            css_files[file] = css_provider;
         }
     }
 }
 
+void WayfireShellApp::remove_css_file(const std::string& file)
+{
+    auto it = css_files.find(file);
+    if (it != css_files.end())
+    {
+        Gtk::StyleContext::remove_provider_for_display(Gdk::Display::get_default(), it->second);
+        css_files.erase(it);
+    }
+}
+
+void WayfireShellApp::reload_css_file(const std::string& file)
+{
+    auto it = css_files.find(file);
+    if (!std::filesystem::exists(file))
+    {
+        remove_css_file(file);
+    } else if (it == css_files.end())
+    {
+        add_css_file(file, (file == get_default_css()) ?
+            GTK_STYLE_PROVIDER_PRIORITY_APPLICATION : GTK_STYLE_PROVIDER_PRIORITY_USER);
+    } else
+    {
+        /* Loading into the same provider keeps its place among the others,
+         * and only styles are recomputed, once */
+        it->second->load_from_path(file);
+    }
+}
+
 bool WayfireShellApp::parse_cfgfile(const Glib::ustring & option_name,
     const Glib::ustring & value, bool has_value)
 {
@@ -125,45 +183,179 @@ bool WayfireShellApp::parse_cssfile(const Glib::ustring & option_name,
     return true;
 }
 
-#define INOT_BUF_SIZE (1024 * sizeof(inotify_event))
-char buf[INOT_BUF_SIZE];
+bool WayfireShellApp::parse_tracefile(const Glib::ustring & option_name,
+    const Glib::ustring & value, bool has_value)
+{
+    std::cout << "Writing trace to " << value << std::endl;
+    WfTrace::enable(value);
+    return true;
+}
 
-static void do_reload_css(WayfireShellApp *app)
+bool WayfireShellApp::parse_watchdog(const Glib::ustring & option_name,
+    const Glib::ustring & value, bool has_value)
 {
-    app->on_css_reload();
-    inotify_add_watch(app->inotify_css_fd,
-        app->get_css_config_dir().c_str(),
-        IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE);
+    std::cout << "Reporting main loop stalls over " << value << "ms" << std::endl;
+    WfWatchdog::enable(std::atoi(value.c_str()));
+    return true;
 }
 
-/* Reload file and add next inotify watch */
-static void do_reload_config(WayfireShellApp *app)
+#define INOT_BUF_SIZE (1024 * sizeof(inotify_event))
+alignas(inotify_event) char buf[INOT_BUF_SIZE];
+
+/* Editors often write a file in several steps, each of which is reported.
+ * The config and stylesheets are reloaded once left alone for this long. */
+#define CONFIG_RELOAD_DELAY_MS 100
+
+void WayfireShellApp::watch_config_file()
 {
-    wf::config::load_configuration_options_from_file(
-        app->config, app->get_config_file());
-    app->on_config_reload();
-    inotify_add_watch(app->inotify_fd, app->get_config_file().c_str(), IN_MODIFY);
+    config_watch_lost = inotify_add_watch(inotify_fd, get_config_file().c_str(), IN_MODIFY) < 0;
 }
 
-/* Handle inotify event */
-static bool handle_inotify_event(WayfireShellApp *app, Glib::IOCondition cond)
+bool WayfireShellApp::handle_config_events(Glib::IOCondition cond)
 {
-    /* read, but don't use */
-    read(app->inotify_fd, buf, INOT_BUF_SIZE);
-    do_reload_config(app);
+    ssize_t length = read(inotify_fd, buf, INOT_BUF_SIZE);
+    for (ssize_t offset = 0; offset < length;)
+    {
+        auto event = (inotify_event*)(buf + offset);
+        /* The watched file was deleted or replaced, as editors saving with
+         * a rename do. Its replacement has to be watched anew. */
+        if (event->mask & IN_IGNORED)
+        {
+            config_watch_lost = true;
+        }
+
+        offset += sizeof(inotify_event) + event->len;
+    }
+
+    config_reload_timer.disconnect();
+    config_reload_timer = Glib::signal_timeout().connect([=] ()
+    {
+        reload_config();
+        return false;
+    }, CONFIG_RELOAD_DELAY_MS);
 
     return true;
 }
 
-static bool handle_css_inotify_event(WayfireShellApp *app, Glib::IOCondition cond)
+/* Apply the changes in the config file. Options whose value did not change
+ * are not touched, so that their callbacks do not run. */
+void WayfireShellApp::reload_config()
+{
+    if (config_watch_lost)
+    {
+        watch_config_file();
+    }
+
+    wf::config::config_manager_t loaded;
+    for (auto& section : config.get_all_sections())
+    {
+        loaded.merge_section(section->clone_with_name(section->get_name()));
+    }
+
+    wf::config::load_configuration_options_from_file(loaded, get_config_file());
+
+    bool changed = false;
+    for (auto& section : loaded.get_all_sections())
+    {
+        auto current = config.get_section(section->get_name());
+        if (!current)
+        {
+            config.merge_section(section);
+            changed = true;
+            continue;
+        }
+
+        for (auto& option : section->get_registered_options())
+        {
+            auto current_option = current->get_option_or(option->get_name());
+            auto compound = std::dynamic_pointer_cast<wf::config::compound_option_t>(option);
+            if (!current_option)
+            {
+                current->register_new_option(option);
+                changed = true;
+            } else if (compound)
+            {
+                /* Compound options have no string form to compare */
+                auto current_compound =
+                    std::dynamic_pointer_cast<wf::config::compound_option_t>(current_option);
+                if (current_compound &&
+                    (current_compound->get_value_untyped() != compound->get_value_untyped()))
+                {
+                    current_compound->set_value_untyped(compound->get_value_untyped());
+                    changed = true;
+                }
+            } else if (current_option->get_value_str() != option->get_value_str())
+            {
+                current_option->set_value_str(option->get_value_str());
+                changed = true;
+            }
+        }
+    }
+
+    if (changed)
+    {
+        on_config_reload();
+    }
+}
+
+int WayfireShellApp::watch_css_dir(const std::filesystem::path& dir)
+{
+    /* Watching a directory again returns the same descriptor, the first
+     * path is kept so that event paths match the loaded files */
+    int wd = inotify_add_watch(inotify_css_fd, dir.c_str(),
+        IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    if (wd >= 0)
+    {
+        css_watch_dirs.emplace(wd, dir);
+    }
+
+    return wd;
+}
+
+bool WayfireShellApp::handle_css_events(Glib::IOCondition cond)
 {
-    /* read, but don't use */
-    read(app->inotify_css_fd, buf, INOT_BUF_SIZE);
-    do_reload_css(app);
+    ssize_t length = read(inotify_css_fd, buf, INOT_BUF_SIZE);
+    for (ssize_t offset = 0; offset < length;)
+    {
+        auto event = (inotify_event*)(buf + offset);
+        auto dir   = css_watch_dirs.find(event->wd);
+        if (event->len && (dir != css_watch_dirs.end()))
+        {
+            /* Other files next to default.css and css_path are not ours */
+            auto file = dir->second / event->name;
+            if (((event->wd == css_dir_watch) && (file.extension() == ".css")) ||
+                (file == get_default_css()) || (file == custom_css))
+            {
+                changed_css_files.insert(file.string());
+            }
+        }
+
+        offset += sizeof(inotify_event) + event->len;
+    }
+
+    if (!changed_css_files.empty())
+    {
+        css_reload_timer.disconnect();
+        css_reload_timer = Glib::signal_timeout().connect([=] ()
+        {
+            reload_changed_css();
+            return false;
+        }, CONFIG_RELOAD_DELAY_MS);
+    }
 
     return true;
 }
 
+void WayfireShellApp::reload_changed_css()
+{
+    for (auto& file : changed_css_files)
+    {
+        reload_css_file(file);
+    }
+
+    changed_css_files.clear();
+}
+
 static void registry_add_object(void *data, struct wl_registry *registry,
     uint32_t name, const char *interface, uint32_t version)
 {
@@ -187,6 +379,7 @@ static struct wl_registry_listener registry_listener =
 
 void WayfireShellApp::on_activate()
 {
+    WfTraceSpan trace_activate{"on_activate"};
     app->hold();
 
     // load wf-shell if available
@@ -199,27 +392,41 @@ void WayfireShellApp::on_activate()
         std::exit(-1);
     }
 
-    wl_registry *registry = wl_display_get_registry(wl_display);
-    wl_registry_add_listener(registry, &registry_listener, this);
-    wl_display_roundtrip(wl_display);
+    {
+        WfTraceSpan trace_roundtrip{"registry roundtrip"};
+        wl_registry *registry = wl_display_get_registry(wl_display);
+        wl_registry_add_listener(registry, &registry_listener, this);
+        wl_display_roundtrip(wl_display);
+    }
 
     std::vector<std::string> xmldirs(1, METADATA_DIR);
 
     // setup config
-    this->config = wf::config::build_configuration(
-        xmldirs, SYSCONF_DIR "/wayfire/wf-shell-defaults.ini",
-        get_config_file());
+    {
+        WfTraceSpan trace_config{"build_configuration"};
+        this->config = wf::config::build_configuration(
+            xmldirs, SYSCONF_DIR "/wayfire/wf-shell-defaults.ini",
+            get_config_file());
+    }
 
+    // build_configuration() loaded the file already
     inotify_fd = inotify_init();
-    do_reload_config(this);
+    watch_config_file();
     inotify_css_fd = inotify_init();
-    do_reload_css(this);
+    css_dir_watch  = watch_css_dir(get_css_config_dir());
+    watch_css_dir(std::filesystem::path(get_default_css()).parent_path());
+    css_path = std::make_unique<WfOption<std::string>>("panel/css_path");
+    css_path->set_callback([=] { set_custom_css((std::string)*css_path); });
+    {
+        WfTraceSpan trace_css{"css load"};
+        on_css_reload();
+    }
 
     Glib::signal_io().connect(
-        sigc::bind<0>(&handle_inotify_event, this),
+        sigc::mem_fun(*this, &WayfireShellApp::handle_config_events),
         inotify_fd, Glib::IOCondition::IO_IN | Glib::IOCondition::IO_HUP);
     Glib::signal_io().connect(
-        sigc::bind<0>(&handle_css_inotify_event, this),
+        sigc::mem_fun(*this, &WayfireShellApp::handle_css_events),
         inotify_css_fd, Glib::IOCondition::IO_IN | Glib::IOCondition::IO_HUP);
 
     // Hook up monitor tracking
@@ -264,6 +471,7 @@ void WayfireShellApp::add_output(GMonitor monitor)
         rem_output(monitor);
     });
     // Add to list
+    WfTraceSpan trace_output{"handle_new_output ", monitor->get_connector()};
     monitors.push_back(
         std::make_unique<WayfireOutput>(monitor, this->wf_shell_manager));
     handle_new_output(monitors.back().get());
@@ -293,6 +501,16 @@ WayfireShellApp::WayfireShellApp()
     app->add_main_option_entry(
         sigc::mem_fun(*this, &WayfireShellApp::parse_cssfile),
         "css", 's', "css style directory to use", "directory");
+    app->add_main_option_entry(
+        sigc::mem_fun(*this, &WayfireShellApp::parse_tracefile),
+        "trace", 't', "write a startup trace to file (also WF_SHELL_TRACE)", "file");
+    app->add_main_option_entry(
+        sigc::mem_fun(*this, &WayfireShellApp::parse_watchdog),
+        "watchdog", 'w', "report main loop stalls over ms (also WF_SHELL_WATCHDOG)", "ms");
+
+    // Start right away if enabled through the environment
+    WfTrace::init();
+    WfWatchdog::init();
 
     // Activate app after parsing command line
     app->signal_command_line().connect_notify([=] (auto&)
@@ -302,7 +520,10 @@ WayfireShellApp::WayfireShellApp()
 }
 
 WayfireShellApp::~WayfireShellApp()
-{}
+{
+    config_reload_timer.disconnect();
+    css_reload_timer.disconnect();
+}
 
 std::unique_ptr<WayfireShellApp> WayfireShellApp::instance;
 WayfireShellApp& WayfireShellApp::get()
@@ -1,7 +1,10 @@
 #ifndef WF_SHELL_APP_HPP
 #define WF_SHELL_APP_HPP
 
+#include <filesystem>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <wayfire/config/config-manager.hpp>
 
@@ -13,6 +16,9 @@
 
 using GMonitor = Glib::RefPtr<Gdk::Monitor>;
 
+template<class Type>
+class WfOption;
+
 /**
  * Represents a single output
  */
@@ -38,7 +44,30 @@ class WayfireShellApp
 {
   private:
     std::vector<std::unique_ptr<WayfireOutput>> monitors;
-    std::vector<Glib::RefPtr<Gtk::CssProvider>> css_rules;
+    /* One provider per stylesheet, by path, so that a changed file can be
+     * loaded again without touching the others */
+    std::map<std::string, Glib::RefPtr<Gtk::CssProvider>> css_files;
+    std::set<std::string> changed_css_files;
+    sigc::connection css_reload_timer;
+    /* Watched directories by inotify watch descriptor. Besides the css
+     * directory, these are the directories of default.css and css_path */
+    std::map<int, std::filesystem::path> css_watch_dirs;
+    int css_dir_watch = -1;
+    std::unique_ptr<WfOption<std::string>> css_path;
+    std::string custom_css;
+
+    /* Reloads of the config file are delayed until it was not written to
+     * for a moment, see handle_config_events() */
+    sigc::connection config_reload_timer;
+    bool config_watch_lost = false;
+
+    void watch_config_file();
+    bool handle_config_events(Glib::IOCondition cond);
+    void reload_config();
+    int watch_css_dir(const std::filesystem::path& dir);
+    bool handle_css_events(Glib::IOCondition cond);
+    void reload_changed_css();
+    void set_custom_css(const std::string& file);
 
   protected:
     /** This should be initialized by the subclass in each program which uses
@@ -60,6 +89,10 @@ class WayfireShellApp
         const Glib::ustring & value, bool has_value);
     virtual bool parse_cssfile(const Glib::ustring & option_name,
         const Glib::ustring & value, bool has_value);
+    virtual bool parse_tracefile(const Glib::ustring & option_name,
+        const Glib::ustring & value, bool has_value);
+    virtual bool parse_watchdog(const Glib::ustring & option_name,
+        const Glib::ustring & value, bool has_value);
     virtual void handle_new_output(WayfireOutput *output)
     {}
     virtual void handle_output_removed(WayfireOutput *output)
@@ -78,11 +111,18 @@ class WayfireShellApp
     virtual std::string get_css_config_dir();
     virtual void run(int argc, char **argv);
 
+    /* Called after a reload of the config file changed any option, once
+     * the callbacks of the changed options ran */
     virtual void on_config_reload()
     {}
+    /* Load the default stylesheet, those in the css directory and the one
+     * from panel/css_path */
     void on_css_reload();
     void clear_css_rules();
     void add_css_file(std::string file, int priority);
+    void remove_css_file(const std::string& file);
+    /* Load a stylesheet again after it changed */
+    void reload_css_file(const std::string& file);
 
 
     /**
@@ -0,0 +1,195 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <glibmm/main.h>
+#include <glibmm/miscutils.h>
+#include <wayfire/nonstd/json.hpp>
+
+#include "wf-trace.hpp"
+#include "wf-watchdog.hpp"
+
+struct trace_event_t
+{
+    std::string name;
+    std::string category;
+    /* 'X' for spans, 'i' for instants */
+    char phase;
+    int64_t start;
+    int64_t duration;
+};
+
+/* As early as we can tell, close enough to the start of the process */
+static const int64_t process_start = g_get_monotonic_time();
+
+/* Recording stops this long after it started, or at this many events */
+#define TRACE_DURATION_MS 10000
+#define TRACE_MAX_EVENTS 100000
+
+static bool recording = false;
+static std::string trace_path;
+static std::vector<trace_event_t> trace_events;
+static sigc::connection stop_connection;
+
+static void write_trace()
+{
+    int64_t pid = getpid();
+    wf::json_t trace;
+    trace["displayTimeUnit"] = "ms";
+    trace["traceEvents"]     = wf::json_t::array();
+
+    wf::json_t process_name;
+    process_name["name"] = "process_name";
+    process_name["ph"]   = "M";
+    process_name["pid"]  = pid;
+    process_name["tid"]  = pid;
+    process_name["args"]["name"] = Glib::get_prgname();
+    trace["traceEvents"].append(process_name);
+
+    for (auto& event : trace_events)
+    {
+        wf::json_t json;
+        json["name"] = event.name;
+        json["cat"]  = event.category;
+        json["ph"]   = std::string(1, event.phase);
+        json["ts"]   = event.start;
+        json["pid"]  = pid;
+        json["tid"]  = pid;
+        if (event.phase == 'X')
+        {
+            json["dur"] = event.duration;
+        } else
+        {
+            json["s"] = "p";
+        }
+
+        trace["traceEvents"].append(json);
+    }
+
+    // Replace the file at once, so that it can be read at any time
+    auto tmp_path = trace_path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::trunc);
+    out << trace.serialize();
+    out.close();
+    if (!out || (std::rename(tmp_path.c_str(), trace_path.c_str()) != 0))
+    {
+        std::cerr << "Failed to write trace to " << trace_path << std::endl;
+    }
+}
+
+static void stop_recording()
+{
+    if (!recording)
+    {
+        return;
+    }
+
+    recording = false;
+    stop_connection.disconnect();
+    write_trace();
+    // Writing a large trace is slow, but it is not a stall of the program
+    WfWatchdog::skip_iteration();
+    trace_events.clear();
+    trace_events.shrink_to_fit();
+}
+
+static void add_event(trace_event_t event)
+{
+    trace_events.push_back(std::move(event));
+    if (trace_events.size() >= TRACE_MAX_EVENTS)
+    {
+        stop_recording();
+    }
+}
+
+void WfTrace::init()
+{
+    const char *path = getenv("WF_SHELL_TRACE");
+    if (path && *path)
+    {
+        enable(path);
+    }
+}
+
+bool WfTrace::is_enabled()
+{
+    return recording;
+}
+
+void WfTrace::enable(const std::string& path)
+{
+    trace_path = path;
+    if (recording)
+    {
+        return;
+    }
+
+    recording = true;
+    add_event({"process-start", "wf-shell", 'i', process_start, 0});
+    stop_connection = Glib::signal_timeout().connect([] ()
+    {
+        stop_recording();
+        return false;
+    }, TRACE_DURATION_MS);
+    std::atexit(stop_recording);
+}
+
+void WfTrace::instant(const std::string& name)
+{
+    if (is_enabled())
+    {
+        add_event({name, "wf-shell", 'i', g_get_monotonic_time(), 0});
+    }
+}
+
+void WfTrace::first_frame(Gtk::Widget& widget, const std::string& name)
+{
+    if (is_enabled())
+    {
+        widget.add_tick_callback([name] (const Glib::RefPtr<Gdk::FrameClock>&)
+        {
+            instant(name + ": first frame");
+            return false;
+        });
+    }
+}
+
+void WfTrace::complete(const std::string& name, const std::string& category, int64_t start)
+{
+    if (is_enabled())
+    {
+        add_event({name, category, 'X', start, g_get_monotonic_time() - start});
+    }
+}
+
+WfTraceSpan::WfTraceSpan(const char *name, const char *category)
+{
+    // The watchdog blames stalls on spans
+    if (WfTrace::is_enabled() || WfWatchdog::is_enabled())
+    {
+        this->name     = name;
+        this->category = category;
+        this->start    = g_get_monotonic_time();
+    }
+}
+
+WfTraceSpan::WfTraceSpan(const char *name, const std::string& detail, const char *category)
+{
+    if (WfTrace::is_enabled() || WfWatchdog::is_enabled())
+    {
+        this->name     = name + detail;
+        this->category = category;
+        this->start    = g_get_monotonic_time();
+    }
+}
+
+WfTraceSpan::~WfTraceSpan()
+{
+    if (start >= 0)
+    {
+        WfTrace::complete(name, category, start);
+        WfWatchdog::span_ended(name, start, g_get_monotonic_time());
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef WF_TRACE_HPP
+#define WF_TRACE_HPP
+
+#include <cstdint>
+#include <string>
+#include <gtkmm/widget.h>
+
+/**
+ * Records where time goes, mostly while starting up.
+ *
+ * Tracing is enabled by setting WF_SHELL_TRACE to the file to write to, or
+ * with --trace. Spans are timed with the monotonic clock and written in the
+ * Chrome trace event format, which chrome://tracing and Perfetto can show.
+ * Recording stops some seconds after it started, after a number of events,
+ * or at exit, whichever comes first, and the file is written once then.
+ *
+ * Only to be used from the main thread.
+ */
+class WfTrace
+{
+  public:
+    /* Start recording if WF_SHELL_TRACE is set */
+    static void init();
+    /* Whether events are being recorded */
+    static bool is_enabled();
+    static void enable(const std::string& path);
+
+    /* Record a point in time */
+    static void instant(const std::string& name);
+    /* Record when the widget draws its first frame */
+    static void first_frame(Gtk::Widget& widget, const std::string& name);
+
+    /* Record a span, with start in microseconds of the monotonic clock */
+    static void complete(const std::string& name, const std::string& category, int64_t start);
+};
+
+/* Records the time from its construction to its destruction as a span.
+ * Spans which contain each other show up nested. Spans also name the
+ * culprits of main loop stalls, see WfWatchdog. When neither is enabled,
+ * a span does nothing, and its name is not even put together. */
+class WfTraceSpan
+{
+  public:
+    WfTraceSpan(const char *name, const char *category = "wf-shell");
+    /* Named name followed by detail */
+    WfTraceSpan(const char *name, const std::string& detail, const char *category = "wf-shell");
+    ~WfTraceSpan();
+
+    WfTraceSpan(const WfTraceSpan&) = delete;
+    WfTraceSpan& operator =(const WfTraceSpan&) = delete;
+
+  private:
+    std::string name;
+    const char *category;
+    int64_t start = -1;
+};
+
+#endif /* end of include guard: WF_TRACE_HPP */
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <vector>
+#include <glib.h>
+#include <glib-unix.h>
+#include <signal.h>
+
+#include "wf-trace.hpp"
+#include "wf-watchdog.hpp"
+
+#define DEFAULT_THRESHOLD_MS 50
+/* The histogram covers this many slots of a minute each */
+#define HISTOGRAM_SLOTS 10
+/* Upper bounds of the histogram buckets in ms, the last one is open */
+static const std::vector<int> bucket_bounds = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+#define RECENT_STALLS 20
+
+struct histogram_slot_t
+{
+    int64_t minute = -1;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(bucket_bounds.size() + 1);
+};
+
+struct culprit_t
+{
+    uint64_t count     = 0;
+    int64_t total_us   = 0;
+    int64_t longest_us = 0;
+};
+
+struct stall_t
+{
+    int64_t time;
+    int64_t duration;
+    std::string culprit;
+};
+
+static int64_t threshold_us = -1;
+static GPollFunc original_poll;
+
+/* The iteration being dispatched, started when poll returned */
+static int64_t iteration_start = -1;
+static std::string iteration_culprit;
+static int64_t iteration_culprit_us = 0;
+static std::string iteration_ready;
+
+static histogram_slot_t slots[HISTOGRAM_SLOTS];
+static std::map<std::string, culprit_t> culprits;
+static std::deque<stall_t> recent_stalls;
+
+static size_t get_bucket(int64_t duration_us)
+{
+    auto it = std::lower_bound(bucket_bounds.begin(), bucket_bounds.end(),
+        (int)((duration_us + 999) / 1000));
+    return it - bucket_bounds.begin();
+}
+
+static void record_iteration(int64_t end)
+{
+    int64_t duration = end - iteration_start;
+
+    int64_t minute = end / G_USEC_PER_SEC / 60;
+    auto& slot     = slots[minute % HISTOGRAM_SLOTS];
+    if (slot.minute != minute)
+    {
+        slot = histogram_slot_t{};
+        slot.minute = minute;
+    }
+
+    slot.buckets[get_bucket(duration)]++;
+    if (duration < threshold_us)
+    {
+        return;
+    }
+
+    std::string culprit = iteration_culprit.empty() ?
+        ("unknown, " + iteration_ready) : iteration_culprit;
+
+    auto& stats = culprits[culprit];
+    stats.count++;
+    stats.total_us  += duration;
+    stats.longest_us = std::max(stats.longest_us, duration);
+
+    recent_stalls.push_back({end, duration, culprit});
+    if (recent_stalls.size() > RECENT_STALLS)
+    {
+        recent_stalls.pop_front();
+    }
+
+    std::cerr << "Main loop stalled for " << duration / 1000 << "ms in " << culprit << std::endl;
+    if (WfTrace::is_enabled())
+    {
+        // Only added to the events, the trace is written when recording stops
+        WfTrace::complete("stall: " + culprit, "watchdog", iteration_start);
+    }
+}
+
+static gint watchdog_poll(GPollFD *fds, guint nfds, gint timeout)
+{
+    if (iteration_start >= 0)
+    {
+        record_iteration(g_get_monotonic_time());
+    }
+
+    gint result = original_poll(fds, nfds, timeout);
+
+    iteration_start = g_get_monotonic_time();
+    iteration_culprit.clear();
+    iteration_culprit_us = 0;
+
+    // Without spans, the ready fds are the best hint of what ran
+    if (result == 0)
+    {
+        iteration_ready = "timeout or idle";
+    } else
+    {
+        iteration_ready = "fds";
+        for (guint i = 0; i < nfds; i++)
+        {
+            if (fds[i].revents)
+            {
+                iteration_ready += " " + std::to_string(fds[i].fd);
+            }
+        }
+
+        iteration_ready += " ready";
+    }
+
+    return result;
+}
+
+static gboolean handle_sigusr2(gpointer)
+{
+    WfWatchdog::dump(std::cerr);
+    return G_SOURCE_CONTINUE;
+}
+
+void WfWatchdog::init()
+{
+    const char *threshold = getenv("WF_SHELL_WATCHDOG");
+    if (threshold && *threshold)
+    {
+        enable(atoi(threshold));
+    }
+}
+
+bool WfWatchdog::is_enabled()
+{
+    return threshold_us >= 0;
+}
+
+void WfWatchdog::enable(int threshold_ms)
+{
+    if (threshold_ms <= 0)
+    {
+        threshold_ms = DEFAULT_THRESHOLD_MS;
+    }
+
+    if (threshold_us < 0)
+    {
+        auto context = g_main_context_default();
+        original_poll = g_main_context_get_poll_func(context);
+        g_main_context_set_poll_func(context, watchdog_poll);
+        g_unix_signal_add(SIGUSR2, handle_sigusr2, nullptr);
+    }
+
+    threshold_us = (int64_t)threshold_ms * 1000;
+}
+
+void WfWatchdog::span_ended(const std::string& name, int64_t start, int64_t end)
+{
+    /* The longest span is the outermost one, which is the most useful
+     * name as long as spans wrap distinct pieces of work */
+    if (is_enabled() && (iteration_start >= 0) && (start >= iteration_start) &&
+        (end - start > iteration_culprit_us))
+    {
+        iteration_culprit    = name;
+        iteration_culprit_us = end - start;
+    }
+}
+
+void WfWatchdog::skip_iteration()
+{
+    iteration_start = -1;
+}
+
+void WfWatchdog::dump(std::ostream& out)
+{
+    int64_t minute = g_get_monotonic_time() / G_USEC_PER_SEC / 60;
+    std::vector<uint64_t> buckets(bucket_bounds.size() + 1);
+    for (auto& slot : slots)
+    {
+        if ((slot.minute >= 0) && (minute - slot.minute < HISTOGRAM_SLOTS))
+        {
+            for (size_t i = 0; i < buckets.size(); i++)
+            {
+                buckets[i] += slot.buckets[i];
+            }
+        }
+    }
+
+    out << "Main loop iterations of the last " << HISTOGRAM_SLOTS << " minutes:" << std::endl;
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+        char line[64];
+        if (i < bucket_bounds.size())
+        {
+            snprintf(line, sizeof(line), "  <= %5d ms: %lu", bucket_bounds[i], (unsigned long)buckets[i]);
+        } else
+        {
+            snprintf(line, sizeof(line), "   > %5d ms: %lu", bucket_bounds.back(), (unsigned long)buckets[i]);
+        }
+
+        out << line << std::endl;
+    }
+
+    out << "Stalls over " << threshold_us / 1000 << " ms by culprit:" << std::endl;
+    for (auto& [name, stats] : culprits)
+    {
+        out << "  " << name << ": " << stats.count << " stalls, " << stats.total_us / 1000 <<
+            " ms total, " << stats.longest_us / 1000 << " ms longest" << std::endl;
+    }
+
+    out << "Recent stalls:" << std::endl;
+    for (auto& stall : recent_stalls)
+    {
+        out << "  " << (g_get_monotonic_time() - stall.time) / G_USEC_PER_SEC << "s ago: " <<
+            stall.duration / 1000 << " ms in " << stall.culprit << std::endl;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef WF_WATCHDOG_HPP
+#define WF_WATCHDOG_HPP
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/**
+ * Watches for main loop iterations which take too long, so that freezes can
+ * be traced back to what caused them.
+ *
+ * The poll function of the default main context is wrapped, so the time
+ * from one poll to the next is the time spent dispatching in between. Each
+ * stall over the threshold is blamed on the longest WfTraceSpan which ran
+ * during the iteration, or on the ready file descriptors if there was none,
+ * and printed.
+ *
+ * A histogram of the iteration times of the last minutes, and the stalls
+ * per culprit, are printed on SIGUSR2.
+ *
+ * Enabled by setting WF_SHELL_WATCHDOG to the threshold in milliseconds, or
+ * with --watchdog.
+ */
+class WfWatchdog
+{
+  public:
+    /* Start watching if WF_SHELL_WATCHDOG is set */
+    static void init();
+    static bool is_enabled();
+    static void enable(int threshold_ms);
+
+    /* Called for every span which ended, with times of the monotonic clock
+     * in microseconds */
+    static void span_ended(const std::string& name, int64_t start, int64_t end);
+
+    /* Leave the current iteration out, for work which is known to be slow
+     * and only done on request, such as writing the trace */
+    static void skip_iteration();
+
+    static void dump(std::ostream& out);
+};
+
+#endif /* end of include guard: WF_WATCHDOG_HPP */